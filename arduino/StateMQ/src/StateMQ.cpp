@@ -90,6 +90,8 @@ StateMQ::StateMQ()
     lastUserStateId_(CONNECTED_ID),
     knownStateCount(0),
     connected_(false),
+    visibleId_(OFFLINE_ID),
+    visibleConnected_(false),
     stateCb(nullptr),
     stateCbEx(nullptr),
     stateCbUser(nullptr),
@@ -143,7 +145,14 @@ StateMQ::TaskId StateMQ::taskEvery(const char* name,
     callback,
     nullptr,
     nullptr,
-    enabled
+    enabled,
+    0,
+    0,
+    0,
+    TaskTrigger::Periodic,
+    ANY_STATE,
+    ANY_STATE,
+    nullptr
   };
   return taskCount_++;
 }
@@ -164,7 +173,70 @@ StateMQ::TaskId StateMQ::taskEvery(const char* name,
     nullptr,
     callback,
     user,
-    enabled
+    enabled,
+    0,
+    0,
+    0,
+    TaskTrigger::Periodic,
+    ANY_STATE,
+    ANY_STATE,
+    nullptr
+  };
+  return taskCount_++;
+}
+
+StateMQ::TaskId StateMQ::taskEvery(const char* name,
+                                   uint32_t period_ms,
+                                   uint32_t stackBytes,
+                                   void (*callback)(),
+                                   bool enabled) {
+  TaskId id = taskEvery(name, period_ms, Stack::Small, callback, enabled);
+  if (id == (TaskId)-1) return id;
+
+  Guard g(*this);
+  tasks[id].stackBytes = stackBytes;
+  return id;
+}
+
+StateMQ::TaskId StateMQ::taskEvery(const char* name,
+                                   uint32_t period_ms,
+                                   uint32_t stackBytes,
+                                   void (*callback)(void*),
+                                   void* user,
+                                   bool enabled) {
+  TaskId id = taskEvery(name, period_ms, Stack::Small, callback, user, enabled);
+  if (id == (TaskId)-1) return id;
+
+  Guard g(*this);
+  tasks[id].stackBytes = stackBytes;
+  return id;
+}
+
+StateMQ::TaskId StateMQ::taskOnTransition(const char* name,
+                                          Stack stack,
+                                          void (*callback)(const StateChangeCtx&),
+                                          void* user,
+                                          StateId from,
+                                          StateId to,
+                                          bool enabled) {
+  if (!callback) return (TaskId)-1;
+
+  Guard g(*this);
+  if (taskCount_ >= MAX_TASKS) return (TaskId)-1;
+
+  tasks[taskCount_] = TaskDef{
+    name, 0, stack,
+    nullptr,
+    nullptr,
+    user,
+    enabled,
+    0,
+    0,
+    0,
+    TaskTrigger::Transition,
+    from,
+    to,
+    callback
   };
   return taskCount_++;
 }
@@ -178,6 +250,20 @@ bool StateMQ::taskEnable(TaskId id, bool enable) {
   return true;
 }
 
+bool StateMQ::taskBudget(TaskId id, uint32_t budget_us) {
+  Guard g(*this);
+  if (id >= taskCount_) return false;
+  tasks[id].budget_us = budget_us;
+  return true;
+}
+
+bool StateMQ::taskSlack(TaskId id, uint32_t slack_ms) {
+  Guard g(*this);
+  if (id >= taskCount_) return false;
+  tasks[id].slack_ms = slack_ms;
+  return true;
+}
+
 bool StateMQ::taskEnabled(TaskId id) const {
   Guard g(*this);
   if (id >= taskCount_) return false;
@@ -216,16 +302,21 @@ const char* StateMQ::stateName(StateId id) const {
 
 
 StateMQ::StateId StateMQ::stateId() const {
-  Guard g(*this);
-
-  if (!connected_) return OFFLINE_ID;
-  if (stateId_ >= 2) return stateId_;
-  return CONNECTED_ID;
+  return visibleId_.load(std::memory_order_acquire);
 }
 
 bool StateMQ::connected() const {
-  Guard g(*this);
-  return connected_;
+  return visibleConnected_.load(std::memory_order_acquire);
+}
+
+// Caller holds the lock.
+void StateMQ::publishSnapshot() {
+  StateId id = CONNECTED_ID;
+  if (!connected_) id = OFFLINE_ID;
+  else if (stateId_ >= 2) id = stateId_;
+
+  visibleId_.store(id, std::memory_order_release);
+  visibleConnected_.store(connected_, std::memory_order_release);
 }
 
 void StateMQ::onStateChange(StateChangeCb cb) {
@@ -239,6 +330,12 @@ void StateMQ::onStateChange(StateChangeCbEx cb, void* user) {
   stateCbUser = user;
 }
 
+StateMQ::StateChangeCbEx StateMQ::stateChangeCallback(void** user) const {
+  Guard g(*this);
+  if (user) *user = stateCbUser;
+  return stateCbEx;
+}
+
 // ------------ PLATFORM API ------------
 // Topic/payload matching is string-based; on match we transition using integer state IDs.
 
@@ -269,6 +366,33 @@ bool StateMQ::applyMessage(const char* topic, const char* payload) {
   return false;
 }
 
+bool StateMQ::applyMessage(const char* topic, const char* payload, uint32_t ruleMask) {
+  if (!topic || !payload || !ruleMask) return false;
+
+  StateId matched = CONNECTED_ID;
+  int16_t matchedRule = -1;
+  bool found = false;
+
+  {
+    Guard g(*this);
+    for (size_t i = 0; i < ruleCount_; ++i) {
+      if (!(ruleMask & (1UL << i))) continue;
+      if (std::strcmp(rules[i].message, payload) == 0) {
+        matched = rules[i].stateId;
+        matchedRule = (int16_t)i;
+        found = true;
+        break;
+      }
+    }
+  }
+
+  if (found) {
+    setStateId(matched, true, StateChangeCause::RuleMatch, topic, payload, matchedRule);
+    return true;
+  }
+  return false;
+}
+
 void StateMQ::setConnected(bool connectedIn) {
   StateId target = OFFLINE_ID;
   StateChangeCause cause = connectedIn ? StateChangeCause::Connected : StateChangeCause::Disconn;
@@ -276,6 +400,7 @@ void StateMQ::setConnected(bool connectedIn) {
   {
     Guard g(*this);
     connected_ = connectedIn;
+    publishSnapshot();
 
     if (!connected_) {
       target = OFFLINE_ID;
@@ -297,6 +422,17 @@ const TaskDef& StateMQ::task(size_t index) const {
   return tasks[index];
 }
 
+bool StateMQ::taskWantsTransition(TaskId id, StateId prev, StateId curr) const {
+  Guard g(*this);
+  if (id >= taskCount_) return false;
+
+  const TaskDef& t = tasks[id];
+  if (t.trigger != TaskTrigger::Transition || !t.enabled) return false;
+  if (t.fromState != ANY_STATE && t.fromState != prev) return false;
+  if (t.toState   != ANY_STATE && t.toState   != curr) return false;
+  return true;
+}
+
 size_t StateMQ::ruleCount() const {
   Guard g(*this);
   return ruleCount_;
@@ -350,6 +486,8 @@ void StateMQ::setStateId(StateId desiredId,
       fire = true;
     }
 
+    publishSnapshot();
+
     cb   = stateCb;
     cbEx = stateCbEx;
 
@@ -176,8 +176,7 @@ bool StateMQEsp32::subscribe(const char* topic, int qos) {
     RawSlot& s = raw[rawCount];
     strncpy(s.topic, topic, RAW_TOPIC_LEN);
     s.topic[RAW_TOPIC_LEN - 1] = '\0';
-    s.payload[0] = '\0';
-    s.hasNew = false;
+    resetLatest(s);
 
     rawCount++;
   }
@@ -195,28 +194,32 @@ bool StateMQEsp32::subscribe(const char* topic, int qos) {
   return true;
 }
 
-const char* StateMQEsp32::msg(const char* topic) {
+// Slots are only appended (rawCount grows after the slot is set up), so
+// the lookup needs no lock either.
+const char* StateMQEsp32::msg(const char* topic, size_t* len) {
   if (!topic || !*topic) return nullptr;
 
-  lockCoreBlocking();
-
   int idx = rawIndex(topic);
-  if (idx < 0) {
-    unlockCore();
-    return nullptr;
-  }
+  if (idx < 0) return nullptr;
 
   RawSlot& s = raw[(size_t)idx];
-  if (!s.hasNew) {
-    unlockCore();
-    return nullptr;
-  }
+  if (!(s.latest.load(std::memory_order_relaxed) & LATEST_FRESH)) return nullptr;
 
-  s.hasNew = false;
-  const char* out = s.payload;
+  const uint8_t prev = s.latest.exchange(s.rd, std::memory_order_acq_rel);
+  s.rd = prev & 3U;
 
-  unlockCore();
-  return out;
+  if (len) *len = s.bufLen[s.rd];
+  return s.buf[s.rd];
+}
+
+void StateMQEsp32::resetLatest(RawSlot& s) {
+  for (size_t i = 0; i < 3; ++i) {
+    s.buf[i][0] = '\0';
+    s.bufLen[i] = 0;
+  }
+  s.wr = 0;
+  s.latest.store(1, std::memory_order_relaxed);
+  s.rd = 2;
 }
 
 // Cleanup helpers
@@ -274,8 +277,7 @@ void StateMQEsp32::cleanup(bool disconnect_wifi, bool clear_config) {
     rawCount = 0;
     for (size_t i = 0; i < MAX_RAW_SUBS; ++i) {
       raw[i].topic[0] = '\0';
-      raw[i].payload[0] = '\0';
-      raw[i].hasNew = false;
+      resetLatest(raw[i]);
     }
   }
 
@@ -369,6 +371,7 @@ bool StateMQEsp32::begin(const char* wifi_ssid,
 
   // ---- Create user tasks  ----
   userTasks = nullptr;
+  bool hasEdgeTasks = false;
 
   for (size_t i = 0; i < core.taskCount(); ++i) {
     const statemq::TaskDef& t = core.task(i);
@@ -384,12 +387,16 @@ bool StateMQEsp32::begin(const char* wifi_ssid,
     ctx->handle = nullptr;
     ctx->next = nullptr;
     ctx->id = i;
+    ctx->fnEdge = t.callbackEdge;
+
+    const bool edge = (t.trigger == statemq::TaskTrigger::Transition);
+    if (edge) hasEdgeTasks = true;
 
     TaskHandle_t handle = nullptr;
-    const uint32_t stackBytes = stackBytesFor(t.stack);
+    const uint32_t stackBytes = t.stackBytes ? t.stackBytes : stackBytesFor(t.stack);
 
     BaseType_t ok = xTaskCreatePinnedToCore(
-      user_task_trampoline,
+      edge ? edge_task_trampoline : user_task_trampoline,
       t.name ? t.name : "statemq_task",
       stackBytes / sizeof(StackType_t),
       ctx,
@@ -413,6 +420,9 @@ bool StateMQEsp32::begin(const char* wifi_ssid,
     }
   }
 
+  // transition tasks are fed from the state change hook
+  if (hasEdgeTasks) hookStateChange();
+
   startReconnectTask();
   return true;
 }
@@ -533,18 +543,18 @@ void StateMQEsp32::onMqttEvent(esp_mqtt_event_handle_t event) {
       data[dcopy] = '\0';
 
       lockCoreBlocking();
-
       core.applyMessage(topic, data);
+      unlockCore();
 
       int idx = rawIndex(topic);
       if (idx >= 0) {
         RawSlot& s = raw[(size_t)idx];
-        strncpy(s.payload, data, RAW_PAYLOAD_LEN);
-        s.payload[RAW_PAYLOAD_LEN - 1] = '\0';
-        s.hasNew = true;
-      }
+        std::memcpy(s.buf[s.wr], data, dcopy + 1);
+        s.bufLen[s.wr] = (uint16_t)dcopy;
 
-      unlockCore();
+        const uint8_t prev = s.latest.exchange(s.wr | LATEST_FRESH, std::memory_order_acq_rel);
+        s.wr = prev & 3U;
+      }
       break;
     }
 
@@ -615,7 +625,7 @@ void StateMQEsp32::StatePublishTopic(const char* topic, int qos, bool enable, bo
   hasLastStatePub = false;
   lastStatePub = statemq::StateMQ::OFFLINE_ID;
 
-   core.onStateChange(&StateMQEsp32::on_state_change_trampoline, this);
+  hookStateChange();
 
 }
 
@@ -640,15 +650,42 @@ bool StateMQEsp32::taskEnable(statemq::StateMQ::TaskId id, bool enable) {
   return false;
 }
 
+void StateMQEsp32::setTaskCoreLock(bool enable) {
+  taskCoreLock = enable;
+}
+
+bool StateMQEsp32::taskRunStats(statemq::StateMQ::TaskId id, TaskRunStats& out) const {
+  const UserTaskCtx* cur = userTasks;
+  while (cur) {
+    if (cur->id == id) {
+      out.runs = cur->runs;
+      out.skipped = cur->skipped;
+      out.late = cur->late;
+      return true;
+    }
+    cur = cur->next;
+  }
+  return false;
+}
+
 // trampolines
 void StateMQEsp32::user_task_trampoline(void* arg) {
   UserTaskCtx* ctx = static_cast<UserTaskCtx*>(arg);
   if (!ctx) vTaskDelete(nullptr);
 
+  StateMQEsp32* owner = ctx->owner;
+
   for (;;) {
+    // optional legacy mode: serialize with MQTT processing
+    const bool useLock = owner && owner->taskCoreLock;
     bool locked = true;
-    if (ctx && ctx->owner) {
-      locked = ctx->owner->tryLockCoreForMs(10);
+
+    if (useLock) {
+      locked = owner->tryLockCoreForMs(0);
+      if (!locked) {
+        locked = owner->tryLockCoreForMs(10);
+        if (locked) ctx->late++;
+      }
     }
 
     if (locked) {
@@ -657,11 +694,74 @@ void StateMQEsp32::user_task_trampoline(void* arg) {
       } else if (ctx->fnEx) {
         ctx->fnEx(ctx->user);
       }
+      ctx->runs++;
+
+      if (useLock) owner->unlockCore();
+    } else {
+      ctx->skipped++;
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(ctx->period_ms));
+  }
+}
+
+// Transition tasks block on a direct-to-task notification and run without
+// the core lock, so they may block.
+void StateMQEsp32::edge_task_trampoline(void* arg) {
+  UserTaskCtx* ctx = static_cast<UserTaskCtx*>(arg);
+  if (!ctx) vTaskDelete(nullptr);
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // one wakeup may cover several edges
+    for (;;) {
+      statemq::StateChangeCtx sc;
+      portENTER_CRITICAL(&ctx->lock);
+      const bool have = ctx->edgeCount > 0;
+      if (have) {
+        sc = ctx->edges[ctx->edgeHead];
+        ctx->edgeHead = (uint8_t)((ctx->edgeHead + 1) % EDGE_QUEUE);
+        ctx->edgeCount--;
+      }
+      portEXIT_CRITICAL(&ctx->lock);
 
-      if (ctx && ctx->owner) ctx->owner->unlockCore();
+      if (!have) break;
+      if (ctx->fnEdge) ctx->fnEdge(sc);
     }
+  }
+}
 
-    vTaskDelay(pdMS_TO_TICKS(ctx ? ctx->period_ms : 1000));
+// Edges are queued per task in arrival order; rule strings replace the
+// caller's topic/payload buffers, which do not outlive the callback.
+void StateMQEsp32::dispatchTransition(const statemq::StateMQ::StateChangeCtx& ctx) {
+  UserTaskCtx* cur = userTasks;
+  while (cur) {
+    if (cur->fnEdge && cur->handle &&
+        core.taskWantsTransition(cur->id, ctx.prev, ctx.curr)) {
+      statemq::StateChangeCtx sc = ctx;
+      sc.user = cur->user;
+      sc.topic = nullptr;
+      sc.payload = nullptr;
+      if (ctx.ruleIndex >= 0 && (size_t)ctx.ruleIndex < core.ruleCount()) {
+        const statemq::Rule& r = core.rule((size_t)ctx.ruleIndex);
+        sc.topic = r.topic;
+        sc.payload = r.message;
+      }
+
+      portENTER_CRITICAL(&cur->lock);
+      if (cur->edgeCount == EDGE_QUEUE) {
+        cur->edgeHead = (uint8_t)((cur->edgeHead + 1) % EDGE_QUEUE);
+        cur->edgeCount--;
+        cur->edgesDropped++;
+      }
+      cur->edges[(cur->edgeHead + cur->edgeCount) % EDGE_QUEUE] = sc;
+      cur->edgeCount++;
+      portEXIT_CRITICAL(&cur->lock);
+
+      xTaskNotifyGive(cur->handle);
+    }
+    cur = cur->next;
   }
 }
 
@@ -678,10 +778,30 @@ void StateMQEsp32::mqtt_event_handler_trampoline(void* handler_args,
   self->onMqttEvent((esp_mqtt_event_handle_t)event_data);
 }
 
+// Takes the core's extended hook, keeping whatever the application had
+// registered there so on_state_change_trampoline can forward to it.
+void StateMQEsp32::hookStateChange() {
+  void* user = nullptr;
+  auto cb = core.stateChangeCallback(&user);
+  if (cb != &StateMQEsp32::on_state_change_trampoline) {
+    appStateCb = cb;
+    appStateUser = user;
+  }
+  core.onStateChange(&StateMQEsp32::on_state_change_trampoline, this);
+}
+
 void StateMQEsp32::on_state_change_trampoline(const statemq::StateMQ::StateChangeCtx& ctx) {
   auto* self = static_cast<StateMQEsp32*>(ctx.user);
   if (!self) return;
 
+  if (self->appStateCb) {
+    statemq::StateMQ::StateChangeCtx app = ctx;
+    app.user = self->appStateUser;
+    self->appStateCb(app);
+  }
+
+  self->dispatchTransition(ctx);
+
   if (!self->statePubEnabled) return;
   if (!self->stateTopic || !self->stateTopic[0]) return;
   if (!self->mqtt || !self->mqttConnected) return;
@@ -11,6 +11,8 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 
+#include <atomic>
+
 #ifndef STATEMQ_TASK_PRIORITY_USER
 #define STATEMQ_TASK_PRIORITY_USER 1
 #endif
@@ -47,7 +49,11 @@ public:
   void end(bool disconnect_wifi = false);
 
   bool subscribe(const char* topic, int qos = 0);
-  const char* msg(const char* topic);
+
+  // Newest payload since the last call, or nullptr. Lock-free; the pointer
+  // stays valid until the next msg() on the same topic, which should be
+  // polled from one task.
+  const char* msg(const char* topic, size_t* len = nullptr);
 
   void StatePublishTopic(const char* topic, int qos = -1, bool enable = true, bool retain = true);
 
@@ -68,7 +74,25 @@ public:
   // enable/disable core tasks at runtime
   bool taskEnable(statemq::StateMQ::TaskId id, bool enable);
 
+  // Run user task callbacks while holding the core lock (previous
+  // behavior). A run is skipped if the lock is not free within 10 ms.
+  // Off by default: tasks read state through node.stateId(), which is
+  // lock-free. Call before begin().
+  void setTaskCoreLock(bool enable);
+
+  // Per-task run accounting. skipped: runs dropped because the core lock
+  // was busy; late: runs that had to wait for the core lock.
+  struct TaskRunStats {
+    uint32_t runs;
+    uint32_t skipped;
+    uint32_t late;
+  };
+
+  bool taskRunStats(statemq::StateMQ::TaskId id, TaskRunStats& out) const;
+
 private:
+  static constexpr uint8_t EDGE_QUEUE = 4;
+
   struct UserTaskCtx {
     StateMQEsp32* owner = nullptr;
 
@@ -82,9 +106,25 @@ private:
     UserTaskCtx* next = nullptr;
 
     statemq::StateMQ::TaskId id = 0;
+
+    uint32_t runs = 0;
+    uint32_t skipped = 0;
+    uint32_t late = 0;
+
+    // Transition-triggered tasks: matching edges in arrival order, guarded
+    // by lock. When the task falls EDGE_QUEUE behind, the oldest is dropped.
+    void (*fnEdge)(const statemq::StateChangeCtx&) = nullptr;
+    statemq::StateChangeCtx edges[EDGE_QUEUE]{};
+    uint8_t  edgeHead = 0;
+    uint8_t  edgeCount = 0;
+    uint32_t edgesDropped = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
   };
 
   static void user_task_trampoline(void* arg);
+  static void edge_task_trampoline(void* arg);
+
+  void dispatchTransition(const statemq::StateMQ::StateChangeCtx& ctx);
   static void mqtt_event_handler_trampoline(void* handler_args,
                                             const char* base,
                                             int event_id,
@@ -92,6 +132,7 @@ private:
   static void reconnect_task_trampoline(void* arg);
 
   static void on_state_change_trampoline(const statemq::StateMQ::StateChangeCtx& ctx);
+  void hookStateChange();
 
   void reconnectLoop();
   void startReconnectTask();
@@ -130,11 +171,18 @@ private:
 
   statemq::StateMQ::StateId lastStatePub = statemq::StateMQ::OFFLINE_ID;
   bool hasLastStatePub = false;
+
+  // Application's extended state callback, still called once the
+  // trampoline has taken the core hook.
+  statemq::StateMQ::StateChangeCbEx appStateCb = nullptr;
+  void* appStateUser = nullptr;
   bool  statePubRetain = true;
 
 
   volatile bool mqttConnected = false;
 
+  bool taskCoreLock = false;
+
   uint16_t keepAliveSec = 60;
   int defaultSubQos = 0;
 
@@ -151,12 +199,20 @@ private:
   static constexpr size_t RAW_TOPIC_LEN = 64;
   static constexpr size_t RAW_PAYLOAD_LEN = 128;
 
+  // Latest value, triple-buffered: the MQTT handler fills buf[wr] and
+  // swaps it into `latest`; msg() swaps `latest` with its own buf[rd].
   struct RawSlot {
-    char topic[RAW_TOPIC_LEN];
-    char payload[RAW_PAYLOAD_LEN];
-    volatile bool hasNew;
+    char     topic[RAW_TOPIC_LEN];
+    char     buf[3][RAW_PAYLOAD_LEN];
+    uint16_t bufLen[3];
+    std::atomic<uint8_t> latest; // buffer index | LATEST_FRESH
+    uint8_t  wr;
+    uint8_t  rd;
   };
 
+  static constexpr uint8_t LATEST_FRESH = 0x4;
+  static void resetLatest(RawSlot& s);
+
   RawSlot raw[MAX_RAW_SUBS]{};
   size_t  rawCount = 0;
 
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <atomic>
 
 #if defined(ESP_PLATFORM) || (defined(ARDUINO) && defined(ESP32))
   #include "freertos/FreeRTOS.h"
@@ -22,6 +23,34 @@ enum class Stack {
   Large
 };
 
+// How a scheduled callback is triggered.
+//   Periodic:   runs every period_ms.
+//   Transition: sleeps until a state transition matches its filter.
+enum class TaskTrigger : uint8_t {
+  Periodic,
+  Transition
+};
+
+enum class StateChangeCause : uint8_t {
+  Unknown   = 0,
+  RuleMatch = 1,
+  Connected = 2,
+  Disconn   = 3
+};
+
+struct StateChangeCtx {
+  uint8_t prev;
+  uint8_t desired;
+  uint8_t curr;
+  StateChangeCause cause;
+  int16_t ruleIndex;
+  // Rule that matched, for RuleMatch; nullptr for Connected, Disconn and
+  // Unknown transitions.
+  const char* topic;
+  const char* payload;
+  void* user;
+};
+
 struct TaskDef {
   const char* name;
   uint32_t    period_ms;
@@ -31,6 +60,17 @@ struct TaskDef {
   void      (*callbackEx)(void* user);
   void*       user;
   bool        enabled;
+  // Explicit stack size in bytes; 0 uses the `stack` preset.
+  uint32_t    stackBytes;
+  // Execution budget per run in microseconds; 0 disables overrun checks.
+  uint32_t    budget_us;
+  // How far (ms) a periodic run may move to share a wakeup with others.
+  uint32_t    slack_ms;
+  // Transition-triggered tasks (trigger == Transition)
+  TaskTrigger trigger;
+  uint8_t     fromState;
+  uint8_t     toState;
+  void      (*callbackEdge)(const StateChangeCtx& ctx);
 };
 
 
@@ -68,34 +108,57 @@ public:
                   void* user,
                   bool enabled = true);
 
+  // Same as above with an explicit stack size in bytes (e.g. a size
+  // recommended by the platform's stack profiling).
+  TaskId taskEvery(const char* name,
+                  uint32_t period_ms,
+                  uint32_t stackBytes,
+                  void (*callback)(),
+                  bool enabled = true);
+
+  TaskId taskEvery(const char* name,
+                  uint32_t period_ms,
+                  uint32_t stackBytes,
+                  void (*callback)(void* user),
+                  void* user,
+                  bool enabled = true);
+
+  // Register a callback that runs on its own task each time a transition
+  // matches (from -> to). ANY_STATE matches every state. The callback may
+  // block; ctx.user carries `user`.
+  TaskId taskOnTransition(const char* name,
+                          Stack stack,
+                          void (*callback)(const StateChangeCtx& ctx),
+                          void* user = nullptr,
+                          StateId from = ANY_STATE,
+                          StateId to = ANY_STATE,
+                          bool enabled = true);
+
 
   bool taskEnable(TaskId id, bool enable);
   bool taskEnabled(TaskId id) const;
 
+  // Set the execution budget of a task (0 = none). Platforms measure every
+  // run against it; set before the platform's begin().
+  bool taskBudget(TaskId id, uint32_t budget_us);
+
+  // Allow each run of a periodic task to move by up to +/- slack_ms so the
+  // platform can batch it with other due tasks (see wakeup alignment).
+  // The default slack is 0: such a task keeps its exact schedule and is
+  // never moved onto the alignment grid.
+  bool taskSlack(TaskId id, uint32_t slack_ms);
+
   // Always returns a valid state (OFFLINE, CONNECTED, or user state).
   const char* state() const;
 
+  // Lock-free: reads a snapshot published on every transition, so tasks can
+  // poll it without contending with message processing.
   StateId stateId() const;
 
   bool connected() const;
 
-  enum class StateChangeCause : uint8_t {
-    Unknown   = 0,
-    RuleMatch = 1,
-    Connected = 2,
-    Disconn   = 3
-  };
-
-  struct StateChangeCtx {
-    StateId prev;
-    StateId desired;
-    StateId curr;
-    StateChangeCause cause;
-    int16_t ruleIndex;
-    const char* topic;
-    const char* payload;
-    void* user;
-  };
+  using StateChangeCause = statemq::StateChangeCause;
+  using StateChangeCtx   = statemq::StateChangeCtx;
 
   using StateChangeCb   = void (*)(StateId prev, StateId next);
   using StateChangeCbEx = void (*)(const StateChangeCtx& ctx);
@@ -103,15 +166,29 @@ public:
   void onStateChange(StateChangeCb cb);
   void onStateChange(StateChangeCbEx cb, void* user = nullptr);
 
+  // Extended callback currently registered (and its user pointer), so a
+  // platform layer hooking transitions can chain to the application's.
+  StateChangeCbEx stateChangeCallback(void** user = nullptr) const;
+
   const char* stateName(StateId id) const;
 
   // Platform backends drive these functions.
   bool applyMessage(const char* topic, const char* payload);
+
+  // Same as above, but only payloads of the rules in `ruleMask` (bit i =
+  // rule i) are compared; the platform has already resolved them by topic.
+  bool applyMessage(const char* topic, const char* payload, uint32_t ruleMask);
   void setConnected(bool connected);
 
   size_t taskCount() const;
   const TaskDef& task(size_t index) const;
 
+  // Capacity of the task table, for platforms that preallocate per task.
+  static constexpr size_t taskCapacity() { return MAX_TASKS; }
+
+  // True if transition-triggered task `id` wants the prev -> curr edge.
+  bool taskWantsTransition(TaskId id, StateId prev, StateId curr) const;
+
   size_t ruleCount() const;
   const Rule& rule(size_t index) const;
 
@@ -121,6 +198,9 @@ public:
   static constexpr StateId OFFLINE_ID   = 0;
   static constexpr StateId CONNECTED_ID = 1;
 
+  // Wildcard for transition filters.
+  static constexpr StateId ANY_STATE    = 0xFF;
+
   SemaphoreHandle_t mutexHandle() const { return mutex; }
 
 private:
@@ -150,6 +230,7 @@ private:
 
   // Maximum number of (topic, payload) → state rules.
   static constexpr size_t MAX_RULES        = 32;
+  static_assert(MAX_RULES <= 32, "rule masks are 32 bits wide");
 
   // Maximum number of scheduled periodic tasks.
   static constexpr size_t MAX_TASKS        = 8;
@@ -171,6 +252,13 @@ private:
   size_t   knownStateCount;
 
   bool     connected_;
+
+  // Snapshot of stateId()/connected() for lock-free readers; written
+  // under the lock whenever stateId_ or connected_ change.
+  std::atomic<StateId> visibleId_;
+  std::atomic<bool>    visibleConnected_;
+  void publishSnapshot();
+
   StateChangeCb   stateCb;
   StateChangeCbEx stateCbEx;
   void*           stateCbUser;
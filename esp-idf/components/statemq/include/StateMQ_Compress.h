@@ -0,0 +1,184 @@
+// StateMQ_Compress.h
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Small LZ77 payload compression for large, repetitive publishes. Header
+// only and free of ESP-IDF dependencies so backend tooling can decode
+// what nodes send; the only working memory is a caller-owned Workspace.
+//
+// Compressed payload:
+//
+//   [0x00]['Z'][plain length u16 LE][LZF-style token stream]
+//
+// Text payloads never start with a NUL byte, so the two marker bytes tell
+// a receiver the payload is compressed. Tokens:
+//
+//   000LLLLL                   literal run of L + 1 bytes
+//   LLLOOOOO [ext] OOOOOOOO    match; length L + 2 (L == 7 adds ext),
+//                              distance O + 1 (up to 8 KB back)
+
+namespace statemq {
+namespace compress {
+
+static constexpr uint8_t MARKER0    = 0x00;
+static constexpr uint8_t MARKER1    = 'Z';
+static constexpr size_t  HEADER_LEN = 4;
+static constexpr size_t  MAX_PLAIN  = 0xFFFE;
+
+static constexpr size_t  HASH_LOG   = 10;
+static constexpr size_t  HASH_SIZE  = (size_t)1 << HASH_LOG;
+static constexpr size_t  MAX_OFF    = 1 << 13;
+static constexpr size_t  MAX_LIT    = 32;
+static constexpr size_t  MAX_MATCH  = 7 + 255 + 2;
+
+// Match finder state, 2 KB; one per compressing context.
+struct Workspace {
+  uint16_t head[HASH_SIZE]; // position + 1, 0 = empty
+};
+
+inline bool isCompressed(const void* data, size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  return p && len >= HEADER_LEN && p[0] == MARKER0 && p[1] == MARKER1;
+}
+
+// Plain length announced by a compressed payload's header.
+inline size_t plainLength(const void* data, size_t len) {
+  if (!isCompressed(data, len)) return 0;
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  return (size_t)p[2] | ((size_t)p[3] << 8);
+}
+
+inline uint32_t hash3(const uint8_t* p) {
+  const uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Returns the compressed size including the header, or 0 when the result
+// would not fit in `outCap` or would not be smaller than the input.
+inline size_t compress(const void* src, size_t inLen, void* dst, size_t outCap, Workspace& ws) {
+  const uint8_t* in = static_cast<const uint8_t*>(src);
+  uint8_t* out = static_cast<uint8_t*>(dst);
+
+  if (!in || !out || inLen == 0 || inLen > MAX_PLAIN) return 0;
+  if (outCap > inLen) outCap = inLen; // no gain, send it plain
+  if (outCap < HEADER_LEN + 2) return 0;
+
+  memset(ws.head, 0, sizeof(ws.head));
+
+  out[0] = MARKER0;
+  out[1] = MARKER1;
+  out[2] = (uint8_t)(inLen & 0xFF);
+  out[3] = (uint8_t)(inLen >> 8);
+
+  size_t ip = 0;
+  size_t op = HEADER_LEN + 1; // room for the first literal control byte
+  size_t lit = 0;
+
+  while (ip < inLen) {
+    size_t len = 0;
+    size_t off = 0;
+
+    if (ip + 2 < inLen) {
+      const uint32_t h = hash3(in + ip);
+      const size_t ref = ws.head[h];
+      ws.head[h] = (uint16_t)(ip + 1);
+
+      if (ref && ip - (ref - 1) <= MAX_OFF) {
+        const size_t r = ref - 1;
+        if (in[r] == in[ip] && in[r + 1] == in[ip + 1] && in[r + 2] == in[ip + 2]) {
+          size_t maxLen = inLen - ip;
+          if (maxLen > MAX_MATCH) maxLen = MAX_MATCH;
+          len = 3;
+          while (len < maxLen && in[r + len] == in[ip + len]) ++len;
+          off = ip - r - 1;
+        }
+      }
+    }
+
+    if (!len) {
+      if (op + 1 >= outCap) return 0;
+      out[op++] = in[ip++];
+      if (++lit == MAX_LIT) {
+        out[op - lit - 1] = (uint8_t)(lit - 1);
+        lit = 0;
+        op++;
+      }
+      continue;
+    }
+
+    // close the literal run, or take back its unused control byte
+    if (lit) out[op - lit - 1] = (uint8_t)(lit - 1);
+    else op--;
+    lit = 0;
+
+    if (op + 4 >= outCap) return 0;
+
+    const size_t l = len - 2;
+    if (l < 7) {
+      out[op++] = (uint8_t)((off >> 8) + (l << 5));
+    } else {
+      out[op++] = (uint8_t)((off >> 8) + (7 << 5));
+      out[op++] = (uint8_t)(l - 7);
+    }
+    out[op++] = (uint8_t)(off & 0xFF);
+    op++; // next literal control byte
+
+    for (size_t k = ip + 1; k < ip + len && k + 2 < inLen; ++k) {
+      ws.head[hash3(in + k)] = (uint16_t)(k + 1);
+    }
+    ip += len;
+  }
+
+  if (lit) out[op - lit - 1] = (uint8_t)(lit - 1);
+  else op--;
+
+  return op;
+}
+
+// Returns the plain length, 0 if the payload is malformed or its plain
+// form does not fit in `outCap`.
+inline size_t decompress(const void* src, size_t inLen, void* dst, size_t outCap) {
+  const uint8_t* in = static_cast<const uint8_t*>(src);
+  uint8_t* out = static_cast<uint8_t*>(dst);
+
+  const size_t plain = plainLength(in, inLen);
+  if (!plain || !out || plain > outCap) return 0;
+
+  size_t ip = HEADER_LEN;
+  size_t op = 0;
+
+  while (ip < inLen) {
+    const uint8_t c = in[ip++];
+
+    if (c < MAX_LIT) {
+      const size_t n = (size_t)c + 1;
+      if (ip + n > inLen || op + n > plain) return 0;
+      memcpy(out + op, in + ip, n);
+      ip += n;
+      op += n;
+      continue;
+    }
+
+    size_t l = c >> 5;
+    if (l == 7) {
+      if (ip >= inLen) return 0;
+      l += in[ip++];
+    }
+    if (ip >= inLen) return 0;
+
+    const size_t back = ((size_t)(c & 0x1F) << 8) + in[ip++] + 1;
+    const size_t len = l + 2;
+    if (back > op || op + len > plain) return 0;
+
+    // byte by byte: the match may overlap what it produces
+    for (size_t i = 0; i < len; ++i, ++op) out[op] = out[op - back];
+  }
+
+  return (op == plain) ? op : 0;
+}
+
+} // namespace compress
+} // namespace statemq
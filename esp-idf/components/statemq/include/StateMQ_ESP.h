@@ -1,17 +1,47 @@
 // StateMQ_ESP.h
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 
 #include "StateMQ.h"
+#include "StateMQ_Compress.h"
+#include "StateMQ_Outbox.h"
+#include "StateMQ_StateCodec.h"
 
 extern "C" {
+#include "sdkconfig.h"
 #include "mqtt_client.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 }
 
+// Static task allocation (menuconfig -> StateMQ). Task stacks and TCBs come
+// from pools inside StateMQEsp instead of the heap.
+#if defined(CONFIG_STATEMQ_STATIC_TASKS)
+  #define STATEMQ_STATIC_TASKS        1
+  #define STATEMQ_STATIC_SMALL_TASKS  CONFIG_STATEMQ_STATIC_SMALL_TASKS
+  #define STATEMQ_STATIC_MEDIUM_TASKS CONFIG_STATEMQ_STATIC_MEDIUM_TASKS
+  #define STATEMQ_STATIC_LARGE_TASKS  CONFIG_STATEMQ_STATIC_LARGE_TASKS
+#endif
+
+#ifndef STATEMQ_STATIC_TASKS
+#define STATEMQ_STATIC_TASKS 0
+#endif
+
+// Payload compression (menuconfig -> StateMQ). Reserves the fixed
+// buffers used to compress publishes and expand received payloads.
+#if defined(CONFIG_STATEMQ_COMPRESSION)
+  #define STATEMQ_COMPRESSION          1
+  #define STATEMQ_COMPRESS_MAX_PAYLOAD CONFIG_STATEMQ_COMPRESS_MAX_PAYLOAD
+#endif
+
+#ifndef STATEMQ_COMPRESSION
+#define STATEMQ_COMPRESSION 0
+#endif
+
 namespace statemq {
 
 class StateMQEsp {
@@ -31,8 +61,123 @@ public:
 
   void setDefaultPublishQos(int qos);
 
-  bool subscribe(const char* topic, int qos = 0);
-  const char* msg(const char* topic);
+  // QoS 1/2 duplicate suppression. A message flagged dup whose packet id,
+  // topic and payload hash were seen within `window_ms` is dropped before
+  // rule matching and raw delivery (stream sinks still see its chunks).
+  // The per-topic form overrides the global window; 0 disables. Off by
+  // default.
+  void setDuplicateWindow(uint32_t window_ms);
+  bool setDuplicateWindow(const char* topic, uint32_t window_ms);
+
+  // Redeliveries dropped, in total or for one topic.
+  uint32_t duplicatesSuppressed() const;
+  uint32_t duplicatesSuppressed(const char* topic) const;
+
+  // Retained sync window. After (re)subscribing, retained messages that
+  // match rules are collected instead of applied, keeping the latest one
+  // per rule group (the rules of one topic). When every SUBACK has arrived
+  // (or after timeout_ms) the collected matches are applied in arrival
+  // order, one per group. A live message during the window supersedes
+  // everything collected so far. 0 disables (default).
+  void setRetainedSync(uint32_t timeout_ms);
+
+  // Retained rule matches that were superseded inside a sync window.
+  uint32_t retainedCollapsed() const;
+
+  // Inbound rate limiting. Each limit is a token bucket refilled at
+  // `rate_per_s` messages per second, holding up to `burst` tokens. A
+  // message needs a token from its topic's bucket and from the global one;
+  // when either is empty its action applies:
+  //   Drop     - discard the message
+  //   Coalesce - hold only the newest message per topic, delivered when a
+  //              token frees (a global Coalesce limit keeps one per topic)
+  //   Defer    - hold messages in arrival order (up to HELD_SLOTS in total)
+  // Held messages are released from the one-shot timer task. Configure
+  // before begin(); rate_per_s = 0 removes a limit.
+  enum class RateAction : uint8_t { Drop, Coalesce, Defer };
+
+  struct RateStats {
+    uint32_t accepted;  // delivered, immediately or after being held
+    uint32_t dropped;   // discarded (Drop, or no room to hold)
+    uint32_t coalesced; // held messages replaced by a newer one
+    uint32_t deferred;  // messages that were held
+  };
+
+  bool setRateLimit(const char* topic, uint16_t rate_per_s, uint16_t burst,
+                    RateAction action = RateAction::Drop);
+  void setGlobalRateLimit(uint16_t rate_per_s, uint16_t burst,
+                          RateAction action = RateAction::Drop);
+
+  bool rateStats(const char* topic, RateStats& out) const;
+  RateStats rateStats() const;
+
+  // Small handle to a raw subscription, valid until end(). Converts to
+  // false when the subscription failed.
+  struct RawHandle {
+    uint8_t index = 0xFF;
+    operator bool() const { return index != 0xFF; }
+  };
+
+  // Returns the newest payload if one arrived since the last call, else
+  // nullptr; `len` receives its length. The pointer stays valid until the
+  // next msg() on the same subscription, which should be polled from one
+  // task. Never blocks the MQTT task.
+  RawHandle subscribe(const char* topic, int qos = 0);
+  const char* msg(const char* topic, size_t* len = nullptr);
+
+  // O(1): indexes the slot directly instead of looking the topic up.
+  const char* msg(RawHandle h, size_t* len = nullptr);
+
+  // Raw subscriptions accept MQTT wildcard filters ("sensors/+/temp",
+  // "sensors/#"). Callbacks receive the concrete topic of each message;
+  // msg()/peek() return the latest/queued payloads matching the filter.
+
+  // Push-style raw subscription: `callback` receives every complete
+  // message on the topic. By default it runs on the esp-mqtt task; with
+  // deferred = true it runs on a StateMQ dispatcher task instead, so it
+  // may block without stalling MQTT (messages are dropped and counted if
+  // the dispatcher queue is full).
+  using RawCallback = void (*)(const char* topic,
+                               const char* payload,
+                               size_t len,
+                               void* user);
+
+  RawHandle subscribe(const char* topic, int qos, RawCallback callback,
+                      void* user = nullptr, bool deferred = false);
+
+  // Deferred callbacks dropped because the dispatcher queue was full.
+  uint32_t callbackDrops() const;
+
+  // Queued raw subscription: keeps up to `depth` messages of up to
+  // `maxLen` bytes each in a ring carved from a preallocated pool, so
+  // messages arriving between polls are not lost. When the ring is full
+  // new messages are dropped and counted. One reader task per topic.
+  RawHandle subscribe(const char* topic, int qos, size_t depth, size_t maxLen = 64);
+
+  // Oldest queued message (NUL-terminated) or nullptr if empty. The
+  // pointer stays valid until pop(). len receives the payload length.
+  const char* peek(const char* topic, size_t* len = nullptr);
+  bool pop(const char* topic);
+
+  const char* peek(RawHandle h, size_t* len = nullptr);
+  bool pop(RawHandle h);
+
+  // Messages dropped because the topic's ring was full.
+  uint32_t overflows(const char* topic) const;
+
+  // Streaming subscription: every chunk of a message is handed to `sink`
+  // as it arrives (esp-mqtt splits payloads larger than its buffer), with
+  // its offset and the total message length. Nothing is buffered, so the
+  // payload may be any size. The message is complete when
+  // offset + len == total.
+  using StreamSink = void (*)(const char* topic,
+                              const char* chunk,
+                              size_t len,
+                              size_t offset,
+                              size_t total,
+                              void* user);
+
+  bool subscribeStream(const char* topic, int qos, StreamSink sink, void* user = nullptr);
 
   bool begin(const char* wifi_ssid,
              const char* wifi_pass,
@@ -41,10 +186,137 @@ public:
 
   void end(bool disconnect_wifi = false);
 
+  // While disconnected (or while an offline backlog is replaying) the
+  // message goes to the offline queue if one is configured; `priority`
+  // only matters for OfflinePolicy::DropLowest.
   bool publish(const char* topic,
                const char* payload,
                int qos = -1,
-               bool retain = false);
+               bool retain = false,
+               uint8_t priority = 0);
+
+  // Offline queue: up to `maxMessages` messages / `maxBytes` bytes of
+  // topic + payload, preallocated (at most OFFLINE_MAX_MSGS and
+  // OFFLINE_POOL_BYTES). When full:
+  //   Reject     - the new message is dropped
+  //   DropOldest - oldest messages are evicted until it fits
+  //   DropLowest - lowest-priority (then oldest) messages at or below the
+  //                new message's priority are evicted
+  // After MQTT_EVENT_CONNECTED the queue is replayed in order through the
+  // client's outbox, one message every `replayIntervalMs` (0 = all at
+  // once); a message the outbox refuses stays queued and is retried.
+  // maxMessages = 0 disables it (default).
+  enum class OfflinePolicy : uint8_t { Reject, DropOldest, DropLowest };
+
+  struct OfflineStats {
+    uint32_t queued;
+    uint32_t dropped;
+    uint32_t replayed;
+    uint16_t depth;  // messages waiting now
+    uint16_t bytes;
+  };
+
+  static constexpr size_t OFFLINE_MAX_MSGS   = 32;
+  static constexpr size_t OFFLINE_POOL_BYTES = 4096;
+
+  bool setOfflineQueue(size_t maxMessages, size_t maxBytes,
+                       OfflinePolicy policy = OfflinePolicy::DropOldest,
+                       uint16_t replayIntervalMs = 20);
+  OfflineStats offlineStats() const;
+
+  // Non-blocking publish: the message is copied into the client's outbox
+  // (esp_mqtt_client_enqueue) and written by the MQTT task, so the caller
+  // never waits on the socket. Returns the message id as a ticket (> 0
+  // for QoS 1/2, 0 for QoS 0) or -1 if it could not be queued.
+  //
+  // For QoS 1/2 `done` runs on the MQTT task with ok = true once the broker
+  // acknowledges (MQTT_EVENT_PUBLISHED), or ok = false when the message is
+  // dropped from the outbox (MQTT_EVENT_DELETED) or the client is stopped.
+  // QoS 0 is not tracked. Up to MAX_INFLIGHT tracked publishes at a time.
+  using PublishTicket = int;
+  using PublishDone = void (*)(PublishTicket ticket, bool ok, void* user);
+
+  PublishTicket publishAsync(const char* topic,
+                             const char* payload,
+                             int qos = -1,
+                             bool retain = false,
+                             PublishDone done = nullptr,
+                             void* user = nullptr);
+
+  // Tracked publishes waiting for PUBLISHED/DELETED.
+  size_t publishesInFlight() const;
+
+  // Persistent outbox (survives reboots and brownouts). publishDurable()
+  // appends the message to a CRC-checked log in the flash partition
+  // `label` (or a file on host/linux targets); while connected the log is
+  // streamed to the broker through the client's outbox, and each record is
+  // released only after MQTT_EVENT_PUBLISHED (QoS 0: once queued), so
+  // delivery is at-least-once. Open before begin().
+  bool setPersistentOutbox(const char* label, uint32_t segmentBytes = 4096);
+  bool setPersistentOutboxFile(const char* path, uint32_t sizeBytes, uint32_t segmentBytes = 4096);
+
+  bool publishDurable(const char* topic, const char* payload, int qos = -1, bool retain = false);
+  PersistentOutbox::Stats outboxStats() const;
+
+  // Latest-wins publishing: publishLatest() keeps only the newest unsent
+  // payload per topic (an older pending one is replaced in place) and the
+  // pending set is handed to the client's outbox every `flush_ms`, so the
+  // outbox holds at most one message per topic whatever the producer
+  // rate. Up to COALESCE_SLOTS topics of at most RAW_TOPIC_LEN - 1
+  // bytes, kept apart from the subscription topic table; pending values
+  // wait out a disconnect. Payloads are truncated to RAW_PAYLOAD_LEN - 1
+  // bytes.
+  static constexpr size_t COALESCE_SLOTS = 8;
+
+  struct CoalesceStats {
+    uint32_t submitted;
+    uint32_t coalesced; // replaced before being sent
+    uint32_t sent;
+    uint32_t dropped;   // no free slot, or the enqueue failed
+  };
+
+  void setCoalesceInterval(uint32_t flush_ms);
+  bool publishLatest(const char* topic, const char* payload, int qos = -1, bool retain = false);
+  CoalesceStats coalesceStats() const;
+
+  // MQTT 5 topic aliases (needs CONFIG_MQTT_PROTOCOL_5; call before
+  // begin(), 0 disables). Once a topic has gone out ALIAS_AFTER times in a
+  // session through a QoS 0 publish(), it is sent once more with an alias
+  // and afterwards with the alias alone. At most min(max_aliases, the
+  // broker's Topic Alias Maximum) topics are tracked per session; a new
+  // topic takes over the least recently published one's alias. Mappings
+  // restart on every connect. Transparent to callers, except that the
+  // esp-mqtt task does not send while another task's aliased send is in
+  // progress: publish() from an event handler then goes through the
+  // offline queue (or fails without one), publishAsync() returns -1, and
+  // offline replay and the persistent outbox retry from the timer task.
+  static constexpr uint16_t MAX_TOPIC_ALIASES = 16;
+  static constexpr uint8_t  ALIAS_AFTER       = 3;
+
+  bool setTopicAliases(uint16_t max_aliases);
+  uint32_t aliasedPublishes() const;
+
+  // Opt-in per-topic payload compression (CONFIG_STATEMQ_COMPRESSION).
+  // publish() on an enabled topic sends payloads of COMPRESS_MIN bytes or
+  // more in the StateMQ_Compress.h format whenever that is smaller.
+  // Any received payload that starts with the format's marker is expanded
+  // before rules, raw slots, wildcard matches and callbacks see it,
+  // whichever subscription delivered it; stream sinks get the wire bytes.
+  // Both directions are bounded by STATEMQ_COMPRESS_MAX_PAYLOAD. A
+  // payload that does not expand is dropped on an enabled topic and
+  // delivered as sent on any other.
+  static constexpr size_t COMPRESS_MIN = 64;
+
+  struct CompressStats {
+    uint32_t compressed; // publishes sent compressed
+    uint32_t plainBytes; // their size before ...
+    uint32_t wireBytes;  // ... and after compression
+    uint32_t expanded;   // received payloads expanded
+    uint32_t rejected;   // received marked payloads that failed to expand
+  };
+
+  bool setCompression(const char* topic, bool enable = true);
+  CompressStats compressStats() const;
 
   bool connected() const;
 
@@ -53,13 +325,87 @@ public:
   // enable state publish topic in one call
   void StatePublishTopic(const char* topic, int qos = -1, bool enable = true, bool retain = true);
 
+  // Encoding of state publishes. Binary sends a 5..9 byte record (see
+  // StateMQ_StateCodec.h) and, on every connect, a retained schema mapping
+  // StateIds to names on `schema_topic` (default "<state topic>/schema").
+  enum class StatePubFormat : uint8_t { Json, Binary };
+  void StatePublishFormat(StatePubFormat format, const char* schema_topic = nullptr);
+
+  // Wakeup coalescing: periodic tasks follow an absolute schedule whose
+  // runs are snapped to multiples of tick_ms (within each task's slack),
+  // so due tasks wake in the same tick. Only tasks given a slack with
+  // taskSlack() are moved; with the default slack of 0 a task keeps its
+  // exact schedule. Call before begin(); 0 disables it and tasks sleep
+  // period_ms after each run.
+  void setWakeupAlignment(uint32_t tick_ms);
+
+  // Distinct ticks in which StateMQ tasks woke up: total, and the rate
+  // since the previous call to wakeupsPerSecond().
+  uint32_t wakeups() const;
+  uint32_t wakeupsPerSecond();
+
+  // One-shot callbacks run once on the StateMQ timer task (started by
+  // begin()) after delay_ms, or at an absolute uptime in ms. They use
+  // preallocated slots, not task slots, and may be scheduled or cancelled
+  // from any task, including state callbacks. Returns INVALID_ONESHOT (and
+  // logs a warning) if all MAX_ONESHOTS slots are in use.
+  using OneShotId = uint32_t;
+  static constexpr OneShotId INVALID_ONESHOT = 0;
+
+  OneShotId taskAfter(uint32_t delay_ms, void (*callback)(void* user), void* user = nullptr);
+  OneShotId taskAt(uint32_t uptime_ms, void (*callback)(void* user), void* user = nullptr);
+
+  // Returns false if the callback already ran or was cancelled.
+  bool taskCancel(OneShotId id);
+
+  // Stack preset sizes in bytes.
+  static constexpr uint32_t STACK_SMALL_BYTES  = 2048;
+  static constexpr uint32_t STACK_MEDIUM_BYTES = 4096;
+  static constexpr uint32_t STACK_LARGE_BYTES  = 8192;
+
+  // Stack usage of a task created by begin(). peakBytes is the largest
+  // usage observed so far (sampled from the FreeRTOS high-water mark).
+  struct TaskStackStats {
+    const char* name;
+    uint32_t    stackBytes;
+    uint32_t    peakBytes;
+    uint32_t    recommendedBytes;
+  };
+
+  bool taskStackStats(StateMQ::TaskId id, TaskStackStats& out);
+
+  // Execution timing of a task created by begin(). Percentiles come from a
+  // log2 histogram and report the upper bound of the matching bucket.
+  struct TaskTiming {
+    uint32_t runs;
+    uint32_t lastUs;
+    uint32_t maxUs;
+    uint32_t p50Us;
+    uint32_t p95Us;
+    uint32_t p99Us;
+    uint32_t budgetUs;
+    uint32_t overruns;
+  };
+
+  bool taskTiming(StateMQ::TaskId id, TaskTiming& out) const;
+
+  // Called from the task itself when it overruns its budget `consecutive`
+  // times in a row (and again every `consecutive` overruns after that).
+  using TaskOverrunCb = void (*)(StateMQ::TaskId id, uint32_t durationUs,
+                                 uint32_t overruns, void* user);
+  void onTaskOverrun(TaskOverrunCb cb, void* user = nullptr, uint8_t consecutive = 3);
+
+  // Profiling mode: periodically samples every task and logs its peak
+  // usage with a recommended byte size for taskEvery(..., stackBytes, ...).
+  // Call before begin(); period_ms = 0 disables it.
+  void setStackProfiling(uint32_t period_ms);
+
 
 private:
   static char* dupstr(const char* s);
   static void  freestr(char*& s);
 
   void cleanup(bool disconnect_wifi, bool clear_config);
-  void freeQosOverrides();
 
   int  qosForTopic(const char* topic) const;
   void subscribeAllUnique();
@@ -68,22 +414,279 @@ private:
   static constexpr size_t RAW_TOPIC_LEN   = 96;
   static constexpr size_t RAW_PAYLOAD_LEN = 256;
 
+  // Interned topic table shared by rules, raw slots, streams and QoS
+  // overrides. Each distinct topic is stored once in `topicArena` and
+  // resolves through one open-addressing hash (entry = id + 1) to a small
+  // id, so an inbound topic is hashed once and subscription dedupe is a
+  // walk over the table. Writers serialize on topicMux; the MQTT task
+  // reads without locking (entries are complete before they are hashed).
+  static constexpr size_t MAX_TOPICS        = 48;
+  static constexpr size_t TOPIC_HASH_SIZE   = 64;
+  static constexpr size_t TOPIC_ARENA_BYTES = 2048;
+  static_assert((TOPIC_HASH_SIZE & (TOPIC_HASH_SIZE - 1)) == 0 && TOPIC_HASH_SIZE > MAX_TOPICS,
+                "TOPIC_HASH_SIZE must be a power of two larger than MAX_TOPICS");
+
+  // Subscriptions one sync batch can wait on: every interned topic plus
+  // rules whose topic did not fit the table (rule masks are 32 bits).
+  static constexpr size_t MAX_SYNC_SUBS = MAX_TOPICS + 32;
+
+  struct TopicEntry {
+    const char* name;     // in topicArena
+    uint32_t    hash;
+    uint32_t    ruleMask; // core rules on this topic (bit = rule index)
+    int8_t      qos;      // subscribe QoS override, -1 = default
+    uint8_t     raw;      // raw slot + 1
+    uint8_t     stream;   // stream slot + 1
+    uint8_t     limit;    // rate limit slot, 0 = none
+    bool        compress;
+    uint32_t    dedupMs;  // duplicate window, DEDUP_INHERIT = global
+    uint32_t    dups;     // redeliveries dropped
+  };
+
+  // Recent QoS>0 deliveries, overwritten round-robin (MQTT task only).
+  static constexpr size_t   DEDUP_SLOTS   = 16;
+  static constexpr uint32_t DEDUP_INHERIT = UINT32_MAX;
+
+  struct DedupEntry {
+    uint32_t topicHash;
+    uint32_t payloadHash;
+    uint32_t ms;
+    uint16_t msgId;
+  };
+
+  bool isDuplicate();
+
+  static void sync_timeout(void* arg);
+  bool deferRetained(const char* data, uint32_t ruleMask, bool retained);
+  void finishSync();
+  void abortSync();
+
+  // limits[0] is the global bucket; topics reference 1..MAX_RATE_LIMITS.
+  // Tokens are kept in thousandths so refill is integer math per ms.
+  static constexpr size_t MAX_RATE_LIMITS = 8;
+  static constexpr size_t HELD_SLOTS      = 8;
+
+  struct RateLimit {
+    uint16_t   rate;
+    uint16_t   burst;
+    RateAction action;
+    uint32_t   tokens;
+    uint32_t   lastMs;
+    RateStats  stats;
+  };
+
+  struct HeldMsg {
+    uint8_t  limit;    // bucket that held it
+    bool     coalesce;
+    bool     admitted; // tokens taken; waits only for the delivery lock
+    bool     complete; // payload was not truncated
+    bool     retained;
+    int8_t   topicId;
+    uint16_t len;
+    char     topic[RAW_TOPIC_LEN];
+    char     payload[RAW_PAYLOAD_LEN];
+  };
+
+  static void rate_flush(void* arg);
+  void ensureIngestLock();
+  static void refill(RateLimit& l, uint32_t now);
+  bool admit(const char* data, size_t len, bool complete);
+  void holdMessage(uint8_t limit, bool admitted, const char* data, size_t len, bool complete);
+  void flushHeld();
+  bool takeHeld(HeldMsg& out);
+  void scheduleFlush(uint32_t delay_ms);
+  void deliverMessage(int topicId, const char* topic, const char* data, size_t len,
+                      bool complete, bool retained);
+
+  int  topicFind(const char* topic, uint32_t hash) const;
+  int  topicIntern(const char* topic);
+  void syncRuleTopics();
+  uint32_t unmappedRuleMask(const char* topic) const;
+  void resetTopics();
+
+  // Bytes shared by all queued raw subscriptions.
+  static constexpr size_t MAILBOX_POOL_BYTES = 4096;
+
   struct RawSlot {
-    char topic[RAW_TOPIC_LEN];
-    char payload[RAW_PAYLOAD_LEN];
-    bool hasNew;
+    const char* topic; // interned
+
+    // Latest value, triple-buffered. The writer fills buf[wr] and swaps
+    // it into `latest`; msg() swaps `latest` with its own buf[rd]. Neither
+    // side waits, and the reader's buffer is never written under it.
+    char     buf[3][RAW_PAYLOAD_LEN];
+    uint16_t bufLen[3];
+    std::atomic<uint8_t> latest; // buffer index | LATEST_FRESH
+    uint8_t  wr;
+    uint8_t  rd;
+
+    // Optional ring of records [uint16 len][payload][NUL] (stride bytes
+    // each). Single producer (MQTT task), single consumer (user task).
+    uint8_t* ring;
+    uint16_t depth;
+    uint16_t stride;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> dropped;
+
+    // Push delivery
+    RawCallback cb;
+    void*       cbUser;
+    bool        cbDeferred;
   };
 
+  // Deferred raw callback item, copied through rxQueue.
+  static constexpr size_t RX_QUEUE_DEPTH = 8;
+  static constexpr uint32_t STACK_RX_BYTES = 4096;
+
+  struct RxItem {
+    uint8_t  index;
+    uint16_t len;
+    char     topic[RAW_TOPIC_LEN];
+    char     payload[RAW_PAYLOAD_LEN];
+  };
+
+  static void rx_dispatch_task(void* arg);
+  void startRxDispatcher();
+  void deliverRaw(size_t index, const char* topic, const char* data, size_t len);
+  void storeRaw(size_t index, const char* topic, const char* data, size_t len);
+
+  // Wildcard filters live in a trie of topic levels built from node pool
+  // `trie` (node 0 is the root), so matching cost follows the topic's depth
+  // and per-level fan-out rather than the number of filters. Indices are
+  // stored +1; 0 means none.
+  static constexpr size_t MAX_TRIE_NODES = 64;
+
+  struct TrieNode {
+    const char* level;   // points into the interned filter
+    uint8_t     len;
+    uint8_t     child;   // first child
+    uint8_t     sibling; // next sibling
+    uint8_t     exact;   // raw slot of a filter ending at this node
+    uint8_t     multi;   // raw slot of "<this node>/#"
+  };
+
+  static bool isWildcard(const char* topic);
+  bool trieInsert(const char* filter, size_t index);
+  void trieMatch(size_t node, const char* level, bool root, const char* topic,
+                 const char* data, size_t len);
+
+  static constexpr uint8_t LATEST_FRESH = 0x4;
+
+  static void resetLatest(RawSlot& s);
+  void ringPush(RawSlot& s, const char* data, size_t len);
+  RawSlot* rawSlot(RawHandle h);
+
+  static uint32_t hashBytes(const char* p, size_t n, uint32_t h = 2166136261u);
+  static uint32_t topicHash(const char* topic);
+
   int rawIndex(const char* topic) const;
 
+  static constexpr uint8_t EDGE_QUEUE = 4;
+
+  static constexpr size_t MAX_STREAM_SUBS = 4;
+
+  struct StreamSlot {
+    const char* topic; // interned
+    StreamSink sink;
+    void* user;
+  };
+
+
+  static constexpr uint32_t STACK_PROFILE_BYTES = 3072;
+  static constexpr uint32_t STACK_TIMER_BYTES   = 4096;
+
+  // Maximum number of pending one-shot callbacks scheduled by users.
+  static constexpr size_t MAX_ONESHOTS = 16;
+
+  // Internal timer jobs each own a slot after the user ones, so a full
+  // user pool cannot stall them. Each job is pending at most once;
+  // features that need a timer job add it here.
+  enum InternalJob : uint8_t {
+    JOB_SYNC_TIMEOUT,
+    JOB_RATE_FLUSH,
+    JOB_OFFLINE_REPLAY,
+    JOB_COALESCE_FLUSH,
+    JOB_STATE_PUBLISH,
+    JOB_DURABLE_PUMP,
+    INTERNAL_JOBS
+  };
+  static constexpr size_t ONESHOT_SLOTS = MAX_ONESHOTS + INTERNAL_JOBS;
+
+  // One-shot slot; heapPos < 0 when free. gen makes stale ids harmless.
+  struct OneShot {
+    int64_t  dueUs;
+    void   (*cb)(void*);
+    void*    user;
+    uint16_t gen;
+    int8_t   heapPos;
+  };
+
+  static void oneshot_task(void* arg);
+
+  OneShotId scheduleAt(int64_t dueUs, void (*callback)(void*), void* user,
+                       size_t first, size_t last);
+  OneShotId scheduleJob(InternalJob job, uint32_t delay_ms, void (*callback)(void*));
+  bool cancelSlot(OneShotId id, size_t last);
+  void heapSwap(size_t a, size_t b);
+  void heapUp(size_t pos);
+  void heapDown(size_t pos);
+  void heapRemove(size_t pos);
+
+  static constexpr size_t MAX_USER_TASKS = StateMQ::taskCapacity();
+
+  // log2 buckets of run duration in us: bucket b holds [2^b, 2^(b+1)).
+  static constexpr size_t TIMING_BUCKETS = 24;
+
   struct UserTaskCtx {
     void (*cb)();
     void (*cbEx)(void*);
     void* user;
     uint32_t period_ms;
+
+    const char* name = nullptr;
+    uint32_t stackBytes = 0;
+    uint32_t peakBytes = 0;
+
+    StateMQEsp* owner = nullptr;
+    StateMQ::TaskId id = 0;
+
+    // Aligned schedule (ticks): next ideal run, its offset from the grid.
+    TickType_t alignIdeal = 0;
+    TickType_t alignPhase = 0;
+    TickType_t slackTicks = 0;
+
+    // Execution timing
+    uint32_t budgetUs = 0;
+    uint32_t runs = 0;
+    uint32_t lastUs = 0;
+    uint32_t maxUs = 0;
+    uint32_t overruns = 0;
+    uint32_t overrunStreak = 0;
+    uint32_t hist[TIMING_BUCKETS]{};
+
+    // Transition-triggered tasks: matching edges in arrival order, guarded
+    // by lock. When the task falls EDGE_QUEUE behind, the oldest is dropped.
+    void (*cbEdge)(const StateMQ::StateChangeCtx&) = nullptr;
+    StateMQ::StateChangeCtx edges[EDGE_QUEUE]{};
+    uint8_t  edgeHead = 0;
+    uint8_t  edgeCount = 0;
+    uint32_t edgesDropped = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
   };
 
   static void user_task_trampoline(void* arg);
+  static void edge_task_trampoline(void* arg);
+  static void stack_profile_task(void* arg);
+
+  void sampleStackUsage();
+  void noteWakeup();
+  TickType_t nextAlignedWake(UserTaskCtx* ctx);
+  TaskHandle_t createTask(TaskFunction_t fn, const char* name,
+                          uint32_t& stackBytes, void* arg);
+  void releaseTask(TaskHandle_t h);
+  void recordRun(UserTaskCtx* ctx, int64_t startUs);
+
+  void dispatchTransition(const StateMQ::StateChangeCtx& ctx);
 
   static void wifi_event_handler(void* arg,
                                  esp_event_base_t base,
@@ -100,6 +703,35 @@ private:
 
   void onMqttConnected();
   void onMqttDisconnected();
+  void onMqttSubscribed(esp_mqtt_event_handle_t e);
+  void onPublishDone(int msgId, bool ok);
+
+  bool offlinePush(const char* topic, const char* payload, int qos, bool retain, uint8_t priority);
+  void offlineRemove(size_t i);
+  bool durableTake(int msgId, bool ok);
+  void pumpDurable();
+  static void durable_pump(void* arg);
+  bool sendDurable();
+  static void coalesce_flush(void* arg);
+  void flushCoalesced();
+  void armCoalesceFlush();
+
+  // Every publish of this class goes through sendPublish(): with aliases
+  // enabled it holds aliasLock, so the publish property set for one
+  // message cannot be picked up by another. The MQTT task never waits
+  // for it and never touches the property; during another task's aliased
+  // send it does not send at all (aliasBusy()).
+  int sendPublish(const char* topic, const char* data, int len, int qos, bool retain,
+                  bool enqueue);
+  int sendAliased(const char* topic, const char* data, int qos, bool retain);
+  size_t aliasSlot(const char* topic, size_t len, uint32_t hash);
+  bool aliasBusy() const;
+  int sendMessage(const char* topic, const char* msg, int qos, bool retain, bool enqueue);
+  static void offline_replay(void* arg);
+  bool claimReplay();
+  void scheduleReplay(uint32_t delay_ms);
+  void replayOffline();
+  void failInFlight();
   void onMqttData(esp_mqtt_event_handle_t e);
 
   void startMqttIfNeeded();
@@ -135,22 +767,332 @@ private:
   int8_t willQos    = 1;
   bool  willRetain  = true;
 
-  static constexpr size_t MAX_QOS_OVERRIDES = 16;
-  char*  qosTopic[MAX_QOS_OVERRIDES]{};
-  int8_t qosValue[MAX_QOS_OVERRIDES]{};
-  size_t qosCount = 0;
+  TopicEntry   topics[MAX_TOPICS]{};
+  size_t       topicCount = 0;
+  uint8_t      topicHashTab[TOPIC_HASH_SIZE]{};
+  char         topicArena[TOPIC_ARENA_BYTES]{};
+  size_t       topicArenaUsed = 0;
+  size_t       rulesInterned = 0;
+  uint32_t     unmappedRules = 0;  // rules whose topic did not fit the table
+  portMUX_TYPE topicMux = portMUX_INITIALIZER_UNLOCKED;
 
- void** taskHandles = nullptr;
-  UserTaskCtx** taskCtxs = nullptr;    
+  DedupEntry dedup[DEDUP_SLOTS]{};
+  size_t     dedupNext = 0;
+  uint32_t   dedupWindowMs = 0;
+  std::atomic<uint32_t> dupSuppressed{0};
+
+  // Sync window; syncActive and the candidates are guarded by syncMux. The
+  // task that clears syncActive owns the candidates. A candidate is the
+  // matched rule of one rule group, so no payload is copied; groups are
+  // disjoint rule masks, so there are at most 32.
+  struct SyncCandidate {
+    uint32_t group; // rules on the message's topic
+    uint8_t  rule;  // matched rule
+  };
+
+  static constexpr size_t SYNC_GROUPS = 32;
+
+  uint32_t      syncTimeoutMs = 0;
+  portMUX_TYPE  syncMux = portMUX_INITIALIZER_UNLOCKED;
+  bool          syncActive = false;
+  uint16_t      syncPending = 0;
+  int           syncMsgIds[MAX_SYNC_SUBS]{}; // SUBACKs still outstanding
+  OneShotId     syncTimer = INVALID_ONESHOT;
+  SyncCandidate syncCands[SYNC_GROUPS]{};    // arrival order
+  uint8_t       syncCount = 0;
+  std::atomic<uint32_t> syncCollapsed{0};
+
+  // Once a rate limit exists, ingestLock guards the buckets and held
+  // messages (never held across a delivery) and deliverLock serializes
+  // deliveries from the MQTT and timer tasks.
+  RateLimit         limits[MAX_RATE_LIMITS + 1]{};
+  size_t            limitCount = 0;
+  bool              rateLimited = false;
+  HeldMsg           held[HELD_SLOTS]{};
+  size_t            heldCount = 0;
+  OneShotId         flushTimer = INVALID_ONESHOT;
+  StaticSemaphore_t ingestLockBuf;
+  SemaphoreHandle_t ingestLock = nullptr;
+  StaticSemaphore_t deliverLockBuf;
+  SemaphoreHandle_t deliverLock = nullptr;
+
+  void* taskHandles[MAX_USER_TASKS]{};
+  UserTaskCtx* taskCtxs[MAX_USER_TASKS]{};
+  UserTaskCtx  taskCtxPool[MAX_USER_TASKS]{};
   size_t taskHandlesCount = 0;
 
+#if STATEMQ_STATIC_TASKS
+  static constexpr size_t STATIC_TASK_SLOTS =
+      STATEMQ_STATIC_SMALL_TASKS + STATEMQ_STATIC_MEDIUM_TASKS + STATEMQ_STATIC_LARGE_TASKS;
+
+  // Ordered small -> large so first fit is also best fit.
+  struct StaticTaskSlot {
+    StaticTask_t tcb;
+    StackType_t* stack;
+    uint32_t     bytes;
+    TaskHandle_t handle;
+  };
+
+  StackType_t smallStacks[STATEMQ_STATIC_SMALL_TASKS][STACK_SMALL_BYTES / sizeof(StackType_t)];
+  StackType_t mediumStacks[STATEMQ_STATIC_MEDIUM_TASKS][STACK_MEDIUM_BYTES / sizeof(StackType_t)];
+  StackType_t largeStacks[STATEMQ_STATIC_LARGE_TASKS][STACK_LARGE_BYTES / sizeof(StackType_t)];
+  StaticTaskSlot staticSlots[STATIC_TASK_SLOTS]{};
+
+  StackType_t  profileStack[STACK_PROFILE_BYTES / sizeof(StackType_t)];
+  StaticTask_t profileTcb;
+
+  StackType_t  timerStack[STACK_TIMER_BYTES / sizeof(StackType_t)];
+  StaticTask_t timerTcb;
+
+  StackType_t  rxStack[STACK_RX_BYTES / sizeof(StackType_t)];
+  StaticTask_t rxTcb;
+#endif
+
+  TaskOverrunCb overrunCb = nullptr;
+  void*   overrunUser = nullptr;
+  uint8_t overrunLimit = 3;
+
+  OneShot  oneShots[ONESHOT_SLOTS]{};
+  uint8_t  oneShotHeap[ONESHOT_SLOTS]{};
+  size_t   oneShotCount = 0;
+  bool     oneShotInit = false;
+  portMUX_TYPE oneShotMux = portMUX_INITIALIZER_UNLOCKED;
+  TaskHandle_t oneShotTask = nullptr;
+
+  TickType_t alignTicks = 0;
+  portMUX_TYPE wakeMux = portMUX_INITIALIZER_UNLOCKED;
+  TickType_t lastWakeTick = 0;
+  uint32_t wakeupCount = 0;
+  uint32_t wakeRateCount = 0;
+  TickType_t wakeRateTick = 0;
+
+  uint32_t stackProfilePeriodMs = 0;
+  TaskHandle_t stackProfileTask = nullptr;
+
 
   RawSlot raw[MAX_RAW_SUBS]{};
   size_t rawCount = 0;
 
+  TrieNode trie[MAX_TRIE_NODES]{};
+  size_t   trieCount = 1;
+
+  StaticQueue_t rxQueueBuf;
+  uint8_t       rxQueueStorage[RX_QUEUE_DEPTH * sizeof(RxItem)];
+  QueueHandle_t rxQueue = nullptr;
+  TaskHandle_t  rxTask = nullptr;
+  RxItem        rxItem;
+  RxItem        rxSendItem;
+  bool          rxDeferredUsed = false;
+  bool          started = false;
+  std::atomic<uint32_t> rxDrops{0};
+
+  alignas(4) uint8_t mailboxPool[MAILBOX_POOL_BYTES]{};
+  size_t  mailboxUsed = 0;
+
+  StreamSlot streams[MAX_STREAM_SUBS]{};
+  size_t streamCount = 0;
+
+  // Message being reassembled from MQTT_EVENT_DATA fragments (MQTT task only).
+  // Only the first RAW_PAYLOAD_LEN - 1 bytes are kept for rules/raw slots.
+  char   rxTopic[RAW_TOPIC_LEN]{};
+  char   rxData[RAW_PAYLOAD_LEN]{};
+  size_t rxLen = 0;
+  size_t rxNext = 0;
+  size_t rxTotal = 0;
+  int    rxStream = -1;
+  int    rxTopicId = -1;
+  uint32_t rxTopicHash = 0;
+  uint16_t rxMsgId = 0;
+  bool   rxDup = false;
+  bool   rxRetain = false;
+  bool   rxActive = false;
+
+  // Async publish tracking. A slot is reserved (msgId = 0) before the
+  // enqueue so the table cannot overflow; completions that arrive before
+  // the id is stored are parked in `early` and picked up by publishAsync.
+  static constexpr size_t MAX_INFLIGHT = 16;
+  static constexpr size_t EARLY_SLOTS  = 4;
+
+  struct InFlight {
+    bool        used;
+    int         msgId;
+    PublishDone done;
+    void*       user;
+  };
+
+  struct EarlyDone {
+    int  msgId;
+    bool ok;
+  };
+
+  portMUX_TYPE inflightMux = portMUX_INITIALIZER_UNLOCKED;
+  InFlight     inflight[MAX_INFLIGHT]{};
+  size_t       inflightCount = 0;
+  EarlyDone    early[EARLY_SLOTS]{};
+  size_t       earlyNext = 0;
+
+  // Offline queue: records [topic\0][payload\0] packed in arrival order in
+  // offlinePool and indexed by offlineMsgs. Guarded by offlineLock; the
+  // task that set replayScheduled is the only replayer. It copies the head
+  // to replayBuf, publishes it outside the lock and removes it once sent.
+  static constexpr size_t   OFFLINE_RECORD_MAX = 512;
+  static constexpr uint32_t REPLAY_RETRY_MS    = 100;
+
+  struct OfflineMsg {
+    uint16_t offset;
+    uint16_t size;
+    uint16_t topicLen;
+    uint8_t  qos;
+    uint8_t  priority;
+    bool     retain;
+  };
+
+  StaticSemaphore_t offlineLockBuf;
+  SemaphoreHandle_t offlineLock = nullptr;
+  OfflineMsg    offlineMsgs[OFFLINE_MAX_MSGS]{};
+  size_t        offlineCount = 0;
+  size_t        offlineUsed = 0;
+  size_t        offlineMaxMsgs = 0;
+  size_t        offlineMaxBytes = 0;
+  OfflinePolicy offlinePolicy = OfflinePolicy::DropOldest;
+  uint16_t      replayIntervalMs = 0;
+  bool          replayScheduled = false;
+  bool          replayHeadBusy = false;  // offlineMsgs[0] is being sent
+  OfflineStats  offlineCounters{};
+  alignas(4) char offlinePool[OFFLINE_POOL_BYTES]{};
+  char          replayBuf[OFFLINE_RECORD_MAX]{};
+
+  // Persistent outbox replay: at most DURABLE_WINDOW records in flight,
+  // refilled on each PUBLISHED. durableMux guards the window and the pump
+  // flags; the pump owner alone moves the log cursor and uses durableBuf.
+  static constexpr size_t DURABLE_WINDOW = 4;
+
+  struct DurableInFlight {
+    int                     msgId;
+    PersistentOutbox::Ref   ref;
+  };
+
+  struct CoalesceSlot {
+    char        topic[RAW_TOPIC_LEN];
+    uint32_t    hash;
+    char        payload[RAW_PAYLOAD_LEN];
+    uint16_t    len;
+    uint8_t     qos;
+    bool        retain;
+    bool        pending;
+  };
+
+  // Coalescing publish; slots are guarded by coalesceMux and copied to
+  // coalesceOut (timer task only) before being enqueued.
+  portMUX_TYPE  coalesceMux = portMUX_INITIALIZER_UNLOCKED;
+  CoalesceSlot  coalesceSlots[COALESCE_SLOTS]{};
+  size_t        coalesceCount = 0;
+  uint32_t      coalesceMs = 100;
+  bool          coalesceArmed = false;
+  CoalesceStats coalesceCounters{};
+  CoalesceSlot  coalesceOut{};
+
+  // Topic aliases, apart from the topic table so publishing many topics
+  // cannot fill it. Slot i carries alias i + 1. aliasCap drops to the
+  // broker's maximum once a property is refused; aliasSession is bumped
+  // on connect and invalidates every slot. Guarded by aliasLock.
+  struct AliasSlot {
+    char     topic[RAW_TOPIC_LEN];
+    uint32_t hash;
+    uint32_t session;
+    uint32_t lastUse;    // aliasClock at the last publish
+    uint8_t  pubs;       // publishes this session, saturating
+    bool     registered; // the broker knows this topic under the alias
+  };
+
+  AliasSlot         aliasSlots[MAX_TOPIC_ALIASES]{};
+  uint16_t          aliasMax = 0;
+  uint16_t          aliasCap = 0;
+  uint32_t          aliasSession = 1;
+  uint32_t          aliasClock = 0;
+  uint32_t          aliasEvictions = 0;
+  std::atomic<bool> aliasActive{false}; // client property set to an alias, or about to be
+  static constexpr uint32_t ALIAS_AGE_EVICTIONS = 64;
+  uint32_t          aliasSent = 0;
+  TaskHandle_t      mqttTask = nullptr;
+  StaticSemaphore_t aliasLockBuf;
+  SemaphoreHandle_t aliasLock = nullptr;
+
+  CompressStats compressCounters{};
+  size_t        compressTopics = 0;
+
+#if STATEMQ_COMPRESSION
+  // Publish side, shared by all tasks under zLock.
+  StaticSemaphore_t     zLockBuf;
+  SemaphoreHandle_t     zLock = nullptr;
+  compress::Workspace   zWork{};
+  uint8_t               zOut[STATEMQ_COMPRESS_MAX_PAYLOAD];
+
+  // Receive side (MQTT task only).
+  bool                  rxCompressed = false;
+  size_t                zRxLen = 0;
+  uint8_t               zRx[STATEMQ_COMPRESS_MAX_PAYLOAD];
+  char                  zPlain[STATEMQ_COMPRESS_MAX_PAYLOAD + 1];
+#endif
+
+  PersistentOutbox  durable;
+  portMUX_TYPE      durableMux = portMUX_INITIALIZER_UNLOCKED;
+  DurableInFlight   durableInflight[DURABLE_WINDOW]{};
+  size_t            durableCount = 0;
+  bool              durablePumping = false;
+  bool              durableSending = false; // enqueued, msg_id not stored yet
+  bool              durableKick = false;
+  bool              durableRewind = false;
+  bool              durableDeferred = false; // pump job due on the timer task
+  EarlyDone         durableEarly[EARLY_SLOTS]{};
+  size_t            durableEarlyNext = 0;
+  char              durableBuf[PersistentOutbox::MAX_RECORD]{}; // pump owner only
+
   StateMQ::StateId lastStatePub = StateMQ::OFFLINE_ID;
   bool hasLastStatePub = false;
 
+  // Application's extended state callback, still called once the
+  // trampoline has taken the core hook.
+  StateMQ::StateChangeCbEx appStateCb = nullptr;
+  void*                    appStateUser = nullptr;
+  // State publish. Each state's quoted name is prebuilt at begin(), so a
+  // payload is a few memcpys plus the uptime digits. Transitions are only
+  // queued from the state callback; the timer task formats and enqueues.
+  static constexpr size_t STATE_FRAGS       = 34; // OFFLINE, CONNECTED + 32 user states
+  static constexpr size_t STATE_FRAG_LEN    = 18; // '"' + name (<= 15) + '"'
+  static constexpr size_t STATE_PUB_QUEUE   = 8;
+  static constexpr size_t STATE_PAYLOAD_LEN = 96;
+
+  struct StateFrag {
+    char    text[STATE_FRAG_LEN];
+    uint8_t len;
+  };
+
+  struct StatePub {
+    StateMQ::StateId prev;
+    StateMQ::StateId curr;
+    uint8_t          cause;
+    uint8_t          rule;
+    uint32_t         uptime;
+  };
+
+  StateFrag    stateFrags[STATE_FRAGS]{};
+  size_t       stateFragCount = 0;
+  portMUX_TYPE statePubMux = portMUX_INITIALIZER_UNLOCKED;
+  StatePub     statePubQueue[STATE_PUB_QUEUE]{};
+  size_t       statePubHead = 0;
+  size_t       statePubCount = 0;
+  bool         statePubArmed = false;
+  bool         statePubSchema = false; // due before the next record
+  StatePubFormat statePubFormat = StatePubFormat::Json;
+  char*          schemaTopic = nullptr;
+
+  void buildStateFrags();
+  size_t formatStatePub(const StatePub& e, char* out, size_t cap);
+  static void state_publish(void* arg);
+  void publishStates();
+  void publishStateSchema();
+
   static void on_state_change_trampoline(const StateMQ::StateChangeCtx& ctx);
 
 };
@@ -0,0 +1,147 @@
+// StateMQ_Outbox.h
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "esp_partition.h"
+
+extern "C" {
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+}
+
+namespace statemq {
+
+// Append-only message log that survives reboots, kept in a dedicated flash
+// partition or, on host/linux targets, a preallocated file.
+//
+// The region is split into segments of `segmentBytes` (a multiple of the
+// flash erase size) used round-robin, so every sector sees the same number
+// of erases. Each segment starts with a header {magic, seq, eraseCount,
+// crc}; records follow, 4-byte aligned:
+//
+//   [magic u16][len u16][state u8][flags u8][topicLen u16][crc u32]
+//   [topic\0][payload\0]
+//
+// The CRC covers everything but `state`, which starts erased (0xFF) and is
+// cleared in place once the record is released, so releasing never
+// rewrites data. A torn or corrupt record fails its CRC and is skipped.
+// When the writer rotates into a segment that still holds live records,
+// those oldest records are dropped.
+class PersistentOutbox {
+public:
+  static constexpr size_t MAX_RECORD   = 512;
+  static constexpr size_t MAX_SEGMENTS = 16;
+
+  struct Stats {
+    uint32_t appended;
+    uint32_t released;
+    uint32_t dropped;  // lost to segment rotation
+    uint32_t corrupt;  // records failing CRC at mount
+    uint32_t replayed; // records handed out by next()
+    uint32_t live;     // not yet released
+
+    // Wear since open: flashBytes / userBytes is the write amplification.
+    uint32_t userBytes;  // topic + payload bytes appended
+    uint32_t flashBytes; // bytes programmed: records, segment headers, releases
+    uint32_t erases;     // segment erases
+  };
+
+  // Location of a record handed out by next(), valid for release() even
+  // if its segment has been recycled meanwhile (release then does nothing).
+  struct Ref {
+    uint32_t seq;
+    uint16_t seg;
+    uint16_t off;
+  };
+
+  struct Record {
+    Ref         ref;
+    const char* topic;
+    const char* payload;
+    uint8_t     qos;
+    bool        retain;
+  };
+
+  PersistentOutbox();
+  ~PersistentOutbox();
+
+  bool openPartition(const char* label, uint32_t segmentBytes = 4096);
+  bool openFile(const char* path, uint32_t sizeBytes, uint32_t segmentBytes = 4096);
+  void close();
+  bool isOpen() const { return part || file; }
+
+  bool append(const char* topic, const char* payload, uint8_t qos, bool retain);
+
+  // Replay cursor. rewind() moves it to the oldest live record; next()
+  // returns live records in append order. Record strings point into an
+  // internal buffer valid until the next call to next().
+  void rewind();
+  bool next(Record& out);
+
+  bool release(const Ref& ref);
+
+  Stats stats() const;
+
+private:
+  struct SegHeader {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t eraseCount;
+    uint32_t crc;
+  };
+
+  struct RecHeader {
+    uint16_t magic;
+    uint16_t len;
+    uint8_t  state;
+    uint8_t  flags;
+    uint16_t topicLen;
+    uint32_t crc;
+  };
+
+  static constexpr uint32_t SEG_MAGIC = 0x4F514D53; // "SMQO"
+  static constexpr uint16_t REC_MAGIC = 0x5352;     // "RS"
+  static constexpr uint8_t  REC_LIVE  = 0xFF;
+  static constexpr uint8_t  REC_DONE  = 0x00;
+
+  bool mount();
+  bool readAt(uint32_t addr, void* dst, size_t len);
+  bool writeAt(uint32_t addr, const void* src, size_t len);
+  bool eraseSeg(size_t seg);
+  bool formatSeg(size_t seg, uint32_t eraseCount);
+  bool rotate();
+
+  // Reads and validates the record at (seg, off) into rbuf. Returns the
+  // aligned record size, 0 at the end of the segment's records.
+  uint32_t readRecord(size_t seg, uint32_t off, RecHeader& h, bool& valid);
+
+  static uint32_t crc32(uint32_t crc, const void* data, size_t len);
+  static uint32_t recordCrc(const RecHeader& h, const void* data);
+
+  const esp_partition_t* part = nullptr;
+  FILE*    file = nullptr;
+  uint32_t segBytes = 0;
+  size_t   segCount = 0;
+
+  uint32_t segSeq[MAX_SEGMENTS]{};   // 0 = unformatted
+  uint16_t segLive[MAX_SEGMENTS]{};
+  size_t   active = 0;
+  uint32_t writeOff = 0;
+  uint32_t nextSeq = 1;
+
+  size_t   curSeg = 0;
+  uint32_t curOff = 0;
+
+  Stats    counters{};
+
+  uint8_t  wbuf[MAX_RECORD];
+  uint8_t  rbuf[MAX_RECORD];
+
+  StaticSemaphore_t lockBuf;
+  SemaphoreHandle_t lock = nullptr;
+};
+
+} // namespace statemq
@@ -0,0 +1,171 @@
+// StateMQ_StateCodec.h
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Binary state-transition records and the schema that names their ids.
+// Header-only and free of ESP-IDF dependencies so backend tooling can
+// decode what nodes publish with StatePubFormat::Binary.
+//
+// Record (5..9 bytes):
+//
+//   [prev u8][curr u8][cause u8][rule u8][uptime_ms LEB128 varint]
+//
+// `rule` is the matching rule index, or NO_RULE. `cause` follows
+// statemq::StateChangeCause.
+//
+// Schema (retained, published once per connect on "<state topic>/schema"):
+//
+//   {"v":1,"states":["OFFLINE","CONNECTED","IDLE",...]}
+//
+// where the array index is the StateId. State names never contain quotes
+// or backslashes.
+
+namespace statemq {
+namespace statecodec {
+
+static constexpr size_t  RECORD_MAX     = 9;
+static constexpr uint8_t NO_RULE        = 0xFF;
+static constexpr int     SCHEMA_VERSION = 1;
+
+struct StateRecord {
+  uint8_t  prev;
+  uint8_t  curr;
+  uint8_t  cause;
+  uint8_t  rule;
+  uint32_t uptime_ms;
+};
+
+// Returns the encoded size, 0 if `cap` is too small.
+inline size_t encode(const StateRecord& r, uint8_t* out, size_t cap) {
+  if (!out || cap < RECORD_MAX) return 0;
+
+  size_t n = 0;
+  out[n++] = r.prev;
+  out[n++] = r.curr;
+  out[n++] = r.cause;
+  out[n++] = r.rule;
+
+  uint32_t v = r.uptime_ms;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+inline bool decode(const uint8_t* in, size_t len, StateRecord& out) {
+  if (!in || len < 5 || len > RECORD_MAX) return false;
+
+  out.prev  = in[0];
+  out.curr  = in[1];
+  out.cause = in[2];
+  out.rule  = in[3];
+
+  uint32_t v = 0;
+  for (size_t i = 4, shift = 0; i < len; ++i, shift += 7) {
+    if (shift == 28 && (in[i] & 0xF0)) return false;
+    v |= (uint32_t)(in[i] & 0x7F) << shift;
+    if (!(in[i] & 0x80)) {
+      out.uptime_ms = v;
+      return i + 1 == len;
+    }
+  }
+  return false;
+}
+
+inline const char* causeName(uint8_t cause) {
+  switch (cause) {
+    case 1:  return "rule";
+    case 2:  return "connected";
+    case 3:  return "disconnected";
+    default: return "unknown";
+  }
+}
+
+// Writes the schema JSON for `count` names; returns its length, 0 if
+// `cap` is too small.
+inline size_t writeSchema(const char* const* names, size_t count, char* out, size_t cap) {
+  static constexpr char HEAD[] = "{\"v\":1,\"states\":[";
+  static constexpr char TAIL[] = "]}";
+
+  if (!out || cap < sizeof(HEAD) + sizeof(TAIL)) return 0;
+
+  size_t n = sizeof(HEAD) - 1;
+  memcpy(out, HEAD, n);
+
+  for (size_t i = 0; i < count; ++i) {
+    const char*  s = names[i] ? names[i] : "";
+    const size_t l = strlen(s);
+    if (n + l + 3 + sizeof(TAIL) > cap) return 0;
+
+    if (i) out[n++] = ',';
+    out[n++] = '"';
+    memcpy(out + n, s, l);
+    n += l;
+    out[n++] = '"';
+  }
+
+  memcpy(out + n, TAIL, sizeof(TAIL));
+  return n + sizeof(TAIL) - 1;
+}
+
+// Parsed schema for decoding; names are copied into fixed storage.
+class Schema {
+public:
+  static constexpr size_t MAX_STATES = 64;
+  static constexpr size_t NAME_LEN   = 16;
+
+  bool parse(const char* json, size_t len) {
+    count_ = 0;
+    if (!json) return false;
+
+    const char* end = json + len;
+    const char* p = find(json, end, "\"states\"");
+    if (!p) return false;
+    while (p < end && *p != '[') ++p;
+    if (p == end) return false;
+    ++p;
+
+    for (;;) {
+      while (p < end && (*p == ' ' || *p == ',' || *p == '\n' || *p == '\t' || *p == '\r')) ++p;
+      if (p == end) return false;
+      if (*p == ']') return true;
+      if (*p != '"' || count_ >= MAX_STATES) return false;
+
+      const char* q = ++p;
+      while (q < end && *q != '"') ++q;
+      if (q == end) return false;
+
+      size_t l = (size_t)(q - p);
+      if (l > NAME_LEN - 1) l = NAME_LEN - 1;
+      memcpy(names_[count_], p, l);
+      names_[count_][l] = '\0';
+      count_++;
+      p = q + 1;
+    }
+  }
+
+  size_t count() const { return count_; }
+
+  // Unknown ids resolve to nullptr.
+  const char* name(uint8_t id) const { return id < count_ ? names_[id] : nullptr; }
+
+private:
+  static const char* find(const char* p, const char* end, const char* key) {
+    const size_t k = strlen(key);
+    for (; p + k <= end; ++p) {
+      if (memcmp(p, key, k) == 0) return p + k;
+    }
+    return nullptr;
+  }
+
+  char   names_[MAX_STATES][NAME_LEN]{};
+  size_t count_ = 0;
+};
+
+} // namespace statecodec
+} // namespace statemq
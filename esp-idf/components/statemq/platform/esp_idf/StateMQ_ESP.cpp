@@ -17,6 +17,7 @@ namespace statemq {
 
 static const char* TAG_WIFI = "statemq_wifi";
 static const char* TAG_MQTT = "statemq_mqtt";
+static const char* TAG_TASK = "statemq_task";
 
 
 
@@ -24,26 +25,30 @@ static const char* TAG_MQTT = "statemq_mqtt";
 
 static uint32_t stackBytesFor(Stack s) {
   switch (s) {
-    case Stack::Small:  return 2048;
-    case Stack::Medium: return 4096;
-    case Stack::Large:  return 8192;
-    default:            return 2048;
+    case Stack::Small:  return StateMQEsp::STACK_SMALL_BYTES;
+    case Stack::Medium: return StateMQEsp::STACK_MEDIUM_BYTES;
+    case Stack::Large:  return StateMQEsp::STACK_LARGE_BYTES;
+    default:            return StateMQEsp::STACK_SMALL_BYTES;
   }
 }
 
+static uint32_t stackBytesFor(const TaskDef& t) {
+  return t.stackBytes ? t.stackBytes : stackBytesFor(t.stack);
+}
+
+// Peak usage plus 25% headroom, rounded up to 256 bytes.
+static uint32_t recommendedStackBytes(uint32_t peakBytes) {
+  uint32_t r = peakBytes + peakBytes / 4;
+  if (r < 1024) r = 1024;
+  return (r + 255U) & ~255U;
+}
+
 static int clamp_qos(int q) {
   if (q < 0) return 0;
   if (q > 2) return 2;
   return q;
 }
 
-static bool topic_seen(const char* topic, const char* const* seen, size_t seen_n) {
-  for (size_t i = 0; i < seen_n; ++i) {
-    if (seen[i] && topic && std::strcmp(seen[i], topic) == 0) return true;
-  }
-  return false;
-}
-
 static uint32_t uptime_ms() {
   return (uint32_t)(esp_timer_get_time() / 1000ULL);
 }
@@ -71,16 +76,457 @@ void StateMQEsp::user_task_trampoline(void* arg) {
   auto* ctx = static_cast<UserTaskCtx*>(arg);
   if (!ctx) vTaskDelete(nullptr);
 
+  StateMQEsp* self = ctx->owner;
+
   for (;;) {
+    self->noteWakeup();
+
+    const int64_t start = esp_timer_get_time();
     if (ctx->cb) {
       ctx->cb();
     } else if (ctx->cbEx) {
       ctx->cbEx(ctx->user);
     }
-    vTaskDelay(pdMS_TO_TICKS(ctx->period_ms));
+    self->recordRun(ctx, start);
+
+    if (self->alignTicks) {
+      const TickType_t wake = self->nextAlignedWake(ctx);
+      const TickType_t now = xTaskGetTickCount();
+      vTaskDelay(((int32_t)(wake - now) > 0) ? (TickType_t)(wake - now) : 0);
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(ctx->period_ms));
+    }
+  }
+}
+
+// Transition task trampoline: blocks on a direct-to-task notification,
+// so it only wakes when a matching transition has been dispatched.
+void StateMQEsp::edge_task_trampoline(void* arg) {
+  auto* ctx = static_cast<UserTaskCtx*>(arg);
+  if (!ctx) vTaskDelete(nullptr);
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    ctx->owner->noteWakeup();
+
+    // one wakeup may cover several edges
+    for (;;) {
+      StateMQ::StateChangeCtx sc;
+      portENTER_CRITICAL(&ctx->lock);
+      const bool have = ctx->edgeCount > 0;
+      if (have) {
+        sc = ctx->edges[ctx->edgeHead];
+        ctx->edgeHead = (uint8_t)((ctx->edgeHead + 1) % EDGE_QUEUE);
+        ctx->edgeCount--;
+      }
+      portEXIT_CRITICAL(&ctx->lock);
+
+      if (!have) break;
+      const int64_t start = esp_timer_get_time();
+      if (ctx->cbEdge) ctx->cbEdge(sc);
+      ctx->owner->recordRun(ctx, start);
+    }
+  }
+}
+
+// Wakeup coalescing
+
+void StateMQEsp::setWakeupAlignment(uint32_t tick_ms) {
+  alignTicks = pdMS_TO_TICKS(tick_ms);
+}
+
+// Next run on the task's absolute schedule, snapped down to the latest
+// grid point within +slack. Falls back to the ideal time when no grid
+// point lies within +/-slack, and skips runs that are already past; a
+// wake landing on the current tick is still due.
+TickType_t StateMQEsp::nextAlignedWake(UserTaskCtx* ctx) {
+  const TickType_t grid   = alignTicks;
+  const TickType_t period = pdMS_TO_TICKS(ctx->period_ms) ? pdMS_TO_TICKS(ctx->period_ms) : 1;
+  const TickType_t slack  = ctx->slackTicks;
+  const TickType_t now    = xTaskGetTickCount();
+
+  // Skip every run missed while suspended in one step; the loop then runs
+  // again only if snapping moved the wake up to `slack` into the past.
+  TickType_t step = period;
+  const TickType_t behind = (TickType_t)(now - ctx->alignIdeal);
+  if ((int32_t)behind >= 0) step = (TickType_t)((behind / period + 1) * period);
+
+  for (;;) {
+    ctx->alignIdeal += step;
+    ctx->alignPhase = (TickType_t)((ctx->alignPhase + step % grid) % grid);
+
+    const TickType_t over = (TickType_t)((ctx->alignPhase + slack) % grid);
+    TickType_t wake = ctx->alignIdeal;
+    if (over <= 2 * slack) wake = (TickType_t)(ctx->alignIdeal + slack - over);
+
+    if ((int32_t)(wake - now) >= 0) return wake;
+    step = period;
+  }
+}
+
+// Counts ticks, not runs: tasks released in the same tick share a wakeup.
+void StateMQEsp::noteWakeup() {
+  const TickType_t now = xTaskGetTickCount();
+
+  portENTER_CRITICAL(&wakeMux);
+  if (wakeupCount == 0 || now != lastWakeTick) {
+    lastWakeTick = now;
+    wakeupCount++;
+  }
+  portEXIT_CRITICAL(&wakeMux);
+}
+
+uint32_t StateMQEsp::wakeups() const {
+  return wakeupCount;
+}
+
+uint32_t StateMQEsp::wakeupsPerSecond() {
+  const TickType_t now = xTaskGetTickCount();
+  const uint32_t total = wakeupCount;
+
+  const TickType_t dt = (TickType_t)(now - wakeRateTick);
+  const uint32_t dn = total - wakeRateCount;
+  wakeRateTick = now;
+  wakeRateCount = total;
+
+  if (dt == 0) return 0;
+  return (uint32_t)(((uint64_t)dn * configTICK_RATE_HZ) / dt);
+}
+
+// One-shot callbacks
+//
+// Pending one-shots form a binary min-heap on dueUs over fixed slots, so
+// insert and cancel are O(log n). A single timer task sleeps until the
+// earliest deadline and is notified when a new earliest one is inserted.
+
+void StateMQEsp::heapSwap(size_t a, size_t b) {
+  const uint8_t t = oneShotHeap[a];
+  oneShotHeap[a] = oneShotHeap[b];
+  oneShotHeap[b] = t;
+  oneShots[oneShotHeap[a]].heapPos = (int8_t)a;
+  oneShots[oneShotHeap[b]].heapPos = (int8_t)b;
+}
+
+void StateMQEsp::heapUp(size_t pos) {
+  while (pos > 0) {
+    const size_t parent = (pos - 1) / 2;
+    if (oneShots[oneShotHeap[parent]].dueUs <= oneShots[oneShotHeap[pos]].dueUs) break;
+    heapSwap(pos, parent);
+    pos = parent;
+  }
+}
+
+void StateMQEsp::heapDown(size_t pos) {
+  for (;;) {
+    const size_t l = 2 * pos + 1;
+    const size_t r = l + 1;
+    size_t m = pos;
+    if (l < oneShotCount && oneShots[oneShotHeap[l]].dueUs < oneShots[oneShotHeap[m]].dueUs) m = l;
+    if (r < oneShotCount && oneShots[oneShotHeap[r]].dueUs < oneShots[oneShotHeap[m]].dueUs) m = r;
+    if (m == pos) break;
+    heapSwap(pos, m);
+    pos = m;
+  }
+}
+
+void StateMQEsp::heapRemove(size_t pos) {
+  OneShot& o = oneShots[oneShotHeap[pos]];
+  o.heapPos = -1;
+  o.gen++;
+
+  oneShotCount--;
+  if (pos == oneShotCount) return;
+
+  oneShotHeap[pos] = oneShotHeap[oneShotCount];
+  oneShots[oneShotHeap[pos]].heapPos = (int8_t)pos;
+  heapUp(pos);
+  heapDown(pos);
+}
+
+// Takes the first free slot in [first, last).
+StateMQEsp::OneShotId StateMQEsp::scheduleAt(int64_t dueUs, void (*callback)(void*), void* user,
+                                             size_t first, size_t last) {
+  if (!callback) return INVALID_ONESHOT;
+
+  OneShotId id = INVALID_ONESHOT;
+  bool earliest = false;
+
+  portENTER_CRITICAL(&oneShotMux);
+  if (!oneShotInit) {
+    for (size_t i = 0; i < ONESHOT_SLOTS; ++i) oneShots[i].heapPos = -1;
+    oneShotInit = true;
+  }
+
+  for (size_t i = first; i < last; ++i) {
+    OneShot& o = oneShots[i];
+    if (o.heapPos >= 0) continue;
+
+    o.dueUs = dueUs;
+    o.cb = callback;
+    o.user = user;
+    o.heapPos = (int8_t)oneShotCount;
+    oneShotHeap[oneShotCount++] = (uint8_t)i;
+    heapUp((size_t)o.heapPos);
+
+    earliest = (o.heapPos == 0);
+    id = ((OneShotId)o.gen << 16) | (OneShotId)(i + 1);
+    break;
+  }
+  portEXIT_CRITICAL(&oneShotMux);
+
+  if (earliest && oneShotTask) xTaskNotifyGive(oneShotTask);
+  return id;
+}
+
+StateMQEsp::OneShotId StateMQEsp::taskAfter(uint32_t delay_ms, void (*callback)(void*), void* user) {
+  const OneShotId id = scheduleAt(esp_timer_get_time() + (int64_t)delay_ms * 1000, callback, user,
+                                  0, MAX_ONESHOTS);
+  if (id == INVALID_ONESHOT && callback) ESP_LOGW(TAG_TASK, "taskAfter: all one-shot slots in use");
+  return id;
+}
+
+StateMQEsp::OneShotId StateMQEsp::taskAt(uint32_t uptime_ms, void (*callback)(void*), void* user) {
+  const OneShotId id = scheduleAt((int64_t)uptime_ms * 1000, callback, user, 0, MAX_ONESHOTS);
+  if (id == INVALID_ONESHOT && callback) ESP_LOGW(TAG_TASK, "taskAt: all one-shot slots in use");
+  return id;
+}
+
+// Internal jobs run with `this` as their argument. Fails only if the job
+// is still pending, which its owner's armed flag rules out.
+StateMQEsp::OneShotId StateMQEsp::scheduleJob(InternalJob job, uint32_t delay_ms,
+                                              void (*callback)(void*)) {
+  const size_t slot = MAX_ONESHOTS + (size_t)job;
+  const OneShotId id = scheduleAt(esp_timer_get_time() + (int64_t)delay_ms * 1000, callback, this,
+                                  slot, slot + 1);
+  if (id == INVALID_ONESHOT) ESP_LOGE(TAG_TASK, "internal job %u already pending", (unsigned)job);
+  return id;
+}
+
+bool StateMQEsp::taskCancel(OneShotId id) {
+  return cancelSlot(id, MAX_ONESHOTS);
+}
+
+// Cancels `id` if it names a pending slot below `last`.
+bool StateMQEsp::cancelSlot(OneShotId id, size_t last) {
+  const size_t slot = (size_t)(id & 0xFFFFU);
+  if (slot == 0 || slot > last) return false;
+
+  bool ok = false;
+  portENTER_CRITICAL(&oneShotMux);
+  OneShot& o = oneShots[slot - 1];
+  if (o.heapPos >= 0 && o.gen == (uint16_t)(id >> 16)) {
+    heapRemove((size_t)o.heapPos);
+    ok = true;
+  }
+  portEXIT_CRITICAL(&oneShotMux);
+  return ok;
+}
+
+void StateMQEsp::oneshot_task(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (!self) vTaskDelete(nullptr);
+
+  for (;;) {
+    void (*cb)(void*) = nullptr;
+    void* user = nullptr;
+    TickType_t wait = portMAX_DELAY;
+
+    portENTER_CRITICAL(&self->oneShotMux);
+    if (self->oneShotCount > 0) {
+      OneShot& top = self->oneShots[self->oneShotHeap[0]];
+      const int64_t left = top.dueUs - esp_timer_get_time();
+      if (left <= 0) {
+        cb = top.cb;
+        user = top.user;
+        self->heapRemove(0);
+      } else {
+        wait = pdMS_TO_TICKS((uint32_t)((left + 999) / 1000));
+        if (wait == 0) wait = 1;
+      }
+    }
+    portEXIT_CRITICAL(&self->oneShotMux);
+
+    if (cb) {
+      self->noteWakeup();
+      cb(user);
+      continue;
+    }
+
+    ulTaskNotifyTake(pdTRUE, wait);
+  }
+}
+
+// Execution timing
+
+static size_t timingBucket(uint32_t us, size_t n) {
+  size_t b = 0;
+  while (us > 1 && b + 1 < n) {
+    us >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+// Runs on the measured task itself; each counter has a single writer.
+void StateMQEsp::recordRun(UserTaskCtx* ctx, int64_t startUs) {
+  const int64_t d = esp_timer_get_time() - startUs;
+  const uint32_t us = (d > 0) ? (uint32_t)d : 0;
+
+  ctx->runs++;
+  ctx->lastUs = us;
+  if (us > ctx->maxUs) ctx->maxUs = us;
+  ctx->hist[timingBucket(us, TIMING_BUCKETS)]++;
+
+  if (ctx->budgetUs == 0) return;
+
+  if (us <= ctx->budgetUs) {
+    ctx->overrunStreak = 0;
+    return;
+  }
+
+  ctx->overruns++;
+  ctx->overrunStreak++;
+
+  if (overrunCb && overrunLimit && (ctx->overrunStreak % overrunLimit) == 0) {
+    overrunCb(ctx->id, us, ctx->overruns, overrunUser);
+  }
+}
+
+void StateMQEsp::onTaskOverrun(TaskOverrunCb cb, void* user, uint8_t consecutive) {
+  overrunCb = cb;
+  overrunUser = user;
+  overrunLimit = consecutive ? consecutive : 1;
+}
+
+static uint32_t timingPercentile(const uint32_t* hist, size_t n, uint32_t runs, uint32_t pct) {
+  if (runs == 0) return 0;
+
+  const uint64_t want = ((uint64_t)runs * pct + 99U) / 100U;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < n; ++b) {
+    seen += hist[b];
+    if (seen >= want) return (uint32_t)((2ULL << b) - 1U);
+  }
+  return UINT32_MAX;
+}
+
+bool StateMQEsp::taskTiming(StateMQ::TaskId id, TaskTiming& out) const {
+  if (id >= taskHandlesCount) return false;
+
+  const UserTaskCtx* t = taskCtxs[id];
+  if (!t) return false;
+
+  out.runs     = t->runs;
+  out.lastUs   = t->lastUs;
+  out.maxUs    = t->maxUs;
+  out.p50Us    = timingPercentile(t->hist, TIMING_BUCKETS, t->runs, 50);
+  out.p95Us    = timingPercentile(t->hist, TIMING_BUCKETS, t->runs, 95);
+  out.p99Us    = timingPercentile(t->hist, TIMING_BUCKETS, t->runs, 99);
+  out.budgetUs = t->budgetUs;
+  out.overruns = t->overruns;
+  return true;
+}
+
+
+// Stack profiling
+
+void StateMQEsp::sampleStackUsage() {
+  for (size_t i = 0; i < taskHandlesCount; ++i) {
+    UserTaskCtx* t = taskCtxs[i];
+    TaskHandle_t h = (TaskHandle_t)taskHandles[i];
+    if (!t || !h) continue;
+
+    const uint32_t freeBytes =
+        (uint32_t)uxTaskGetStackHighWaterMark(h) * sizeof(StackType_t);
+    const uint32_t used = (freeBytes < t->stackBytes) ? (t->stackBytes - freeBytes) : 0;
+    if (used > t->peakBytes) t->peakBytes = used;
+  }
+}
+
+void StateMQEsp::stack_profile_task(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (!self) vTaskDelete(nullptr);
+
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(self->stackProfilePeriodMs));
+    self->sampleStackUsage();
+
+    for (size_t i = 0; i < self->taskHandlesCount; ++i) {
+      TaskStackStats st{};
+      if (!self->taskStackStats(i, st)) continue;
+      ESP_LOGI(TAG_TASK, "stack %s: size=%u peak=%u recommended=%u",
+               st.name ? st.name : "statemq_task",
+               (unsigned)st.stackBytes,
+               (unsigned)st.peakBytes,
+               (unsigned)st.recommendedBytes);
+    }
+  }
+}
+
+void StateMQEsp::setStackProfiling(uint32_t period_ms) {
+  stackProfilePeriodMs = period_ms;
+}
+
+bool StateMQEsp::taskStackStats(StateMQ::TaskId id, TaskStackStats& out) {
+  if (id >= taskHandlesCount) return false;
+
+  UserTaskCtx* t = taskCtxs[id];
+  if (!t || !taskHandles[id]) return false;
+
+  sampleStackUsage();
+
+  out.name = t->name;
+  out.stackBytes = t->stackBytes;
+  out.peakBytes = t->peakBytes;
+  out.recommendedBytes = recommendedStackBytes(t->peakBytes);
+  return true;
+}
+
+// Task creation. With STATEMQ_STATIC_TASKS the stack and TCB come from the
+// smallest free pool slot that fits; stackBytes is updated to the slot size.
+
+TaskHandle_t StateMQEsp::createTask(TaskFunction_t fn, const char* name,
+                                    uint32_t& stackBytes, void* arg) {
+#if STATEMQ_STATIC_TASKS
+  if (staticSlots[0].stack == nullptr) {
+    size_t n = 0;
+    for (size_t i = 0; i < STATEMQ_STATIC_SMALL_TASKS; ++i)
+      staticSlots[n++] = StaticTaskSlot{{}, smallStacks[i], STACK_SMALL_BYTES, nullptr};
+    for (size_t i = 0; i < STATEMQ_STATIC_MEDIUM_TASKS; ++i)
+      staticSlots[n++] = StaticTaskSlot{{}, mediumStacks[i], STACK_MEDIUM_BYTES, nullptr};
+    for (size_t i = 0; i < STATEMQ_STATIC_LARGE_TASKS; ++i)
+      staticSlots[n++] = StaticTaskSlot{{}, largeStacks[i], STACK_LARGE_BYTES, nullptr};
   }
+
+  for (size_t i = 0; i < STATIC_TASK_SLOTS; ++i) {
+    StaticTaskSlot& slot = staticSlots[i];
+    if (slot.handle || slot.bytes < stackBytes) continue;
+
+    slot.handle = xTaskCreateStatic(fn, name, slot.bytes / sizeof(StackType_t),
+                                    arg, 1, slot.stack, &slot.tcb);
+    if (slot.handle) stackBytes = slot.bytes;
+    return slot.handle;
+  }
+  return nullptr;
+#else
+  TaskHandle_t handle = nullptr;
+  if (xTaskCreate(fn, name, stackBytes / sizeof(StackType_t), arg, 1, &handle) != pdPASS) {
+    return nullptr;
+  }
+  return handle;
+#endif
 }
 
+void StateMQEsp::releaseTask(TaskHandle_t h) {
+  if (!h) return;
+  vTaskDelete(h);
+
+#if STATEMQ_STATIC_TASKS
+  for (size_t i = 0; i < STATIC_TASK_SLOTS; ++i) {
+    if (staticSlots[i].handle == h) staticSlots[i].handle = nullptr;
+  }
+#endif
+}
 
 // Construction / destruction
 
@@ -106,23 +552,12 @@ void StateMQEsp::setDefaultPublishQos(int qos) {
 }
 
 
-void StateMQEsp::freeQosOverrides() {
-  for (size_t i = 0; i < qosCount; ++i) {
-    freestr(qosTopic[i]);
-    qosTopic[i] = nullptr;
-  }
-  qosCount = 0;
-}
-
 int StateMQEsp::qosForTopic(const char* topic) const {
   if (!topic) return defaultSubQos;
 
-  for (size_t i = 0; i < qosCount; ++i) {
-    if (qosTopic[i] && std::strcmp(qosTopic[i], topic) == 0) {
-      return qosValue[i];
-    }
-  }
-  return defaultSubQos;
+  int id = topicFind(topic, topicHash(topic));
+  if (id < 0 || topics[id].qos < 0) return defaultSubQos;
+  return topics[id].qos;
 }
 
 void StateMQEsp::setLastWill(const char* topic,
@@ -157,258 +592,1972 @@ void StateMQEsp::clearLastWill() {
   lwtEnabled = false;
 }
 
-// Raw subscribe
+// Topic table
+
+// FNV-1a over a byte range; `h` chains a previous hash or seed.
+uint32_t StateMQEsp::hashBytes(const char* p, size_t n, uint32_t h) {
+  while (n--) {
+    h ^= (uint8_t)*p++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+uint32_t StateMQEsp::topicHash(const char* topic) {
+  return hashBytes(topic, std::strlen(topic));
+}
+
+int StateMQEsp::topicFind(const char* topic, uint32_t hash) const {
+  size_t pos = hash & (TOPIC_HASH_SIZE - 1);
+  for (size_t n = 0; n < TOPIC_HASH_SIZE; ++n) {
+    const uint8_t e = topicHashTab[pos];
+    if (e == 0) return -1;
+    const TopicEntry& t = topics[e - 1];
+    if (t.hash == hash && std::strcmp(t.name, topic) == 0) return (int)(e - 1);
+    pos = (pos + 1) & (TOPIC_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
+// Returns the id of `topic`, adding it on first use; -1 when the table or
+// the arena is full.
+int StateMQEsp::topicIntern(const char* topic) {
+  if (!topic || !*topic) return -1;
+
+  const uint32_t hash = topicHash(topic);
+  const size_t len = std::strlen(topic) + 1;
+  int id;
+
+  portENTER_CRITICAL(&topicMux);
+  id = topicFind(topic, hash);
+  if (id < 0 && topicCount < MAX_TOPICS && len <= TOPIC_ARENA_BYTES - topicArenaUsed) {
+    char* name = topicArena + topicArenaUsed;
+    std::memcpy(name, topic, len);
+    topicArenaUsed += len;
+
+    id = (int)topicCount;
+    topics[id] = TopicEntry{name, hash, 0, -1, 0, 0, 0, false, DEDUP_INHERIT, 0};
+    topicCount++;
+
+    size_t pos = hash & (TOPIC_HASH_SIZE - 1);
+    while (topicHashTab[pos]) pos = (pos + 1) & (TOPIC_HASH_SIZE - 1);
+    topicHashTab[pos] = (uint8_t)topicCount;
+  }
+  portEXIT_CRITICAL(&topicMux);
+
+  return id;
+}
+
+// Rules live in the core; their topics are interned by index, so rules
+// mapped after begin() are picked up on the next (re)connect. A rule whose
+// topic does not fit the table still works, through a strcmp scan.
+void StateMQEsp::syncRuleTopics() {
+  const size_t n = core.ruleCount();
+
+  for (size_t i = rulesInterned; i < n; ++i) {
+    int id = topicIntern(core.rule(i).topic);
+    if (id < 0) {
+      ESP_LOGE(TAG_MQTT, "topic table full, rule %u on '%s' uses a linear match",
+               (unsigned)i, core.rule(i).topic);
+      unmappedRules |= (1UL << i);
+      continue;
+    }
+
+    portENTER_CRITICAL(&topicMux);
+    topics[id].ruleMask |= (1UL << i);
+    portEXIT_CRITICAL(&topicMux);
+  }
+  rulesInterned = n;
+}
+
+// Rules of `unmappedRules` whose topic equals `topic`.
+uint32_t StateMQEsp::unmappedRuleMask(const char* topic) const {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < rulesInterned; ++i) {
+    if (!(unmappedRules & (1UL << i))) continue;
+    if (std::strcmp(core.rule(i).topic, topic) == 0) mask |= (1UL << i);
+  }
+  return mask;
+}
+
+void StateMQEsp::resetTopics() {
+  portENTER_CRITICAL(&topicMux);
+  std::memset(topicHashTab, 0, sizeof(topicHashTab));
+  for (size_t i = 0; i < MAX_TOPICS; ++i) topics[i] = TopicEntry{};
+  topicCount = 0;
+  topicArenaUsed = 0;
+  rulesInterned = 0;
+  unmappedRules = 0;
+  portEXIT_CRITICAL(&topicMux);
+}
+
+// Duplicate suppression
+
+void StateMQEsp::setDuplicateWindow(uint32_t window_ms) {
+  dedupWindowMs = window_ms;
+}
+
+bool StateMQEsp::setDuplicateWindow(const char* topic, uint32_t window_ms) {
+  const int id = topicIntern(topic);
+  if (id < 0) return false;
+
+  topics[id].dedupMs = window_ms;
+  return true;
+}
+
+uint32_t StateMQEsp::duplicatesSuppressed() const {
+  return dupSuppressed.load(std::memory_order_relaxed);
+}
+
+uint32_t StateMQEsp::duplicatesSuppressed(const char* topic) const {
+  if (!topic) return 0;
+
+  int id = topicFind(topic, topicHash(topic));
+  return (id < 0) ? 0 : topics[id].dups;
+}
+
+// Brokers resend unacknowledged QoS 1 publishes after a reconnect with the
+// dup flag and the original packet id. Every QoS>0 delivery is remembered
+// so a later dup can be recognised; only flagged copies are dropped, since
+// packet ids are reused for new messages once acknowledged.
+bool StateMQEsp::isDuplicate() {
+  if (rxMsgId == 0) return false; // QoS 0 carries no packet id
+
+  uint32_t window = dedupWindowMs;
+  if (rxTopicId >= 0 && topics[rxTopicId].dedupMs != DEDUP_INHERIT) {
+    window = topics[rxTopicId].dedupMs;
+  }
+  if (window == 0) return false;
+
+  const uint32_t ph  = hashBytes(rxData, rxLen, (uint32_t)rxTotal * 16777619u);
+  const uint32_t now = uptime_ms();
+
+  for (DedupEntry& d : dedup) {
+    if (d.msgId != rxMsgId || d.topicHash != rxTopicHash || d.payloadHash != ph) continue;
+    if (now - d.ms > window) continue;
+
+    d.ms = now;
+    if (!rxDup) return false;
+
+    dupSuppressed.fetch_add(1, std::memory_order_relaxed);
+    if (rxTopicId >= 0) topics[rxTopicId].dups++;
+    return true;
+  }
+
+  dedup[dedupNext] = DedupEntry{rxTopicHash, ph, now, rxMsgId};
+  dedupNext = (dedupNext + 1) % DEDUP_SLOTS;
+  return false;
+}
+
+// Retained sync window
+
+void StateMQEsp::setRetainedSync(uint32_t timeout_ms) {
+  syncTimeoutMs = timeout_ms;
+}
+
+uint32_t StateMQEsp::retainedCollapsed() const {
+  return syncCollapsed.load(std::memory_order_relaxed);
+}
+
+void StateMQEsp::sync_timeout(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (self) self->finishSync();
+}
+
+// Returns true when the message was taken as the candidate of its rule
+// group instead of being applied now.
+bool StateMQEsp::deferRetained(const char* data, uint32_t ruleMask, bool retained) {
+  int matched = -1;
+  if (retained) {
+    for (size_t i = 0; i < core.ruleCount() && matched < 0; ++i) {
+      if ((ruleMask & (1UL << i)) && std::strcmp(core.rule(i).message, data) == 0) {
+        matched = (int)i;
+      }
+    }
+  }
+
+  bool deferred = false;
+
+  portENTER_CRITICAL(&syncMux);
+  if (syncActive) {
+    if (!retained) {
+      // live message is newer than anything retained
+      syncCollapsed.fetch_add(syncCount, std::memory_order_relaxed);
+      syncCount = 0;
+    } else if (matched >= 0) {
+      // a newer match of the same group replaces the old one and moves to
+      // the back, keeping arrival order
+      size_t i = 0;
+      while (i < syncCount && syncCands[i].group != ruleMask) ++i;
+      if (i < syncCount) {
+        syncCollapsed.fetch_add(1, std::memory_order_relaxed);
+        for (; i + 1 < syncCount; ++i) syncCands[i] = syncCands[i + 1];
+        syncCount--;
+      }
+      if (syncCount < SYNC_GROUPS) {
+        syncCands[syncCount++] = SyncCandidate{ruleMask, (uint8_t)matched};
+        deferred = true;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&syncMux);
+
+  return deferred;
+}
+
+// Called on the MQTT task (last SUBACK) or the timer task (timeout);
+// whichever closes the window applies the candidates.
+void StateMQEsp::finishSync() {
+  // copied out, so a window reopened on reconnect cannot change them
+  SyncCandidate cands[SYNC_GROUPS];
+
+  portENTER_CRITICAL(&syncMux);
+  const bool owner = syncActive;
+  const size_t count = owner ? syncCount : 0;
+  std::memcpy(cands, syncCands, count * sizeof(cands[0]));
+  const OneShotId timer = syncTimer;
+  syncActive = false;
+  syncCount = 0;
+  syncTimer = INVALID_ONESHOT;
+  portEXIT_CRITICAL(&syncMux);
+
+  if (!owner) return;
+
+  cancelSlot(timer, ONESHOT_SLOTS);
+  for (size_t i = 0; i < count; ++i) {
+    const auto& r = core.rule(cands[i].rule);
+    core.applyMessage(r.topic, r.message, 1UL << cands[i].rule);
+  }
+}
+
+// Disconnected mid-window: the collected state is dropped; the broker
+// resends retained messages on the next subscribe.
+void StateMQEsp::abortSync() {
+  portENTER_CRITICAL(&syncMux);
+  const bool owner = syncActive;
+  const OneShotId timer = syncTimer;
+  syncActive = false;
+  syncCount = 0;
+  syncTimer = INVALID_ONESHOT;
+  portEXIT_CRITICAL(&syncMux);
+
+  if (owner) cancelSlot(timer, ONESHOT_SLOTS);
+}
+
+// Only SUBACKs for the batch sent by subscribeAllUnique() count; acks for
+// subscriptions made elsewhere (or a previous session) are ignored.
+void StateMQEsp::onMqttSubscribed(esp_mqtt_event_handle_t e) {
+  if (!e) return;
+
+  bool done = false;
+  portENTER_CRITICAL(&syncMux);
+  if (syncActive) {
+    for (uint16_t i = 0; i < syncPending; ++i) {
+      if (syncMsgIds[i] != e->msg_id) continue;
+      syncMsgIds[i] = syncMsgIds[--syncPending];
+      done = (syncPending == 0);
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&syncMux);
+
+  if (done) finishSync();
+}
+
+// Inbound rate limiting
+
+void StateMQEsp::ensureIngestLock() {
+  if (!ingestLock) ingestLock = xSemaphoreCreateMutexStatic(&ingestLockBuf);
+  if (!deliverLock) deliverLock = xSemaphoreCreateMutexStatic(&deliverLockBuf);
+  rateLimited = true;
+}
+
+bool StateMQEsp::setRateLimit(const char* topic, uint16_t rate_per_s, uint16_t burst,
+                              RateAction action) {
+  const int id = topicIntern(topic);
+  if (id < 0) return false;
+
+  TopicEntry& t = topics[id];
+  if (!t.limit) {
+    if (rate_per_s == 0) return true;
+    if (limitCount >= MAX_RATE_LIMITS) return false;
+    t.limit = (uint8_t)(++limitCount);
+  }
+
+  const uint16_t b = burst ? burst : 1;
+  limits[t.limit] = RateLimit{rate_per_s, b, action, (uint32_t)b * 1000U, uptime_ms(), {}};
+  ensureIngestLock();
+  return true;
+}
+
+void StateMQEsp::setGlobalRateLimit(uint16_t rate_per_s, uint16_t burst, RateAction action) {
+  const uint16_t b = burst ? burst : 1;
+  limits[0] = RateLimit{rate_per_s, b, action, (uint32_t)b * 1000U, uptime_ms(), {}};
+  if (rate_per_s) ensureIngestLock();
+}
+
+bool StateMQEsp::rateStats(const char* topic, RateStats& out) const {
+  if (!topic) return false;
+
+  int id = topicFind(topic, topicHash(topic));
+  if (id < 0 || !topics[id].limit) return false;
+
+  out = limits[topics[id].limit].stats;
+  return true;
+}
+
+StateMQEsp::RateStats StateMQEsp::rateStats() const {
+  return limits[0].stats;
+}
+
+void StateMQEsp::refill(RateLimit& l, uint32_t now) {
+  const uint32_t cap = (uint32_t)l.burst * 1000U;
+  const uint64_t add = (uint64_t)(now - l.lastMs) * l.rate;
+  l.lastMs = now;
+  l.tokens = (add >= cap - l.tokens) ? cap : l.tokens + (uint32_t)add;
+}
+
+// MQTT task, ingest lock held. True when the message may be delivered
+// now; otherwise the limiting bucket's action has been applied to it.
+bool StateMQEsp::admit(const char* data, size_t len, bool complete) {
+  const uint32_t now = uptime_ms();
+
+  RateLimit* tl = nullptr;
+  if (rxTopicId >= 0 && topics[rxTopicId].limit) tl = &limits[topics[rxTopicId].limit];
+  if (tl && tl->rate == 0) tl = nullptr;
+  RateLimit* gl = limits[0].rate ? &limits[0] : nullptr;
+
+  if (tl) refill(*tl, now);
+  if (gl) refill(*gl, now);
+
+  RateLimit* empty = nullptr;
+  if (tl && tl->tokens < 1000) empty = tl;
+  else if (gl && gl->tokens < 1000) empty = gl;
+
+  if (!empty) {
+    if (tl) { tl->tokens -= 1000; tl->stats.accepted++; }
+    if (gl) { gl->tokens -= 1000; gl->stats.accepted++; }
+    return true;
+  }
+
+  holdMessage((uint8_t)(empty - limits), false, data, len, complete);
+  return false;
+}
+
+// Ingest lock held. `admitted` messages already took their tokens and only
+// wait for the timer task to finish delivering. `data` is the payload as it
+// will be delivered, cut to the held slot.
+void StateMQEsp::holdMessage(uint8_t limit, bool admitted, const char* data, size_t len,
+                             bool complete) {
+  RateLimit& l = limits[limit];
+  if (l.action == RateAction::Drop && !admitted) {
+    l.stats.dropped++;
+    return;
+  }
+
+  // coalescing is per topic, also under the global bucket; topics without
+  // an id (wildcard-only) compare by name
+  HeldMsg* h = nullptr;
+  if (l.action == RateAction::Coalesce && !admitted) {
+    for (size_t i = 0; i < heldCount; ++i) {
+      const HeldMsg& o = held[i];
+      if (!o.coalesce || o.limit != limit || o.topicId != rxTopicId) continue;
+      if (rxTopicId < 0 && std::strcmp(o.topic, rxTopic) != 0) continue;
+
+      h = &held[i];
+      l.stats.coalesced++;
+      break;
+    }
+  }
+
+  if (!h) {
+    if (heldCount >= HELD_SLOTS) {
+      l.stats.dropped++;
+      return;
+    }
+    h = &held[heldCount++];
+    if (!admitted) l.stats.deferred++;
+  }
+
+  h->limit = limit;
+  h->coalesce = (l.action == RateAction::Coalesce) && !admitted;
+  h->admitted = admitted;
+  const size_t n = (len < sizeof(h->payload)) ? len : sizeof(h->payload) - 1;
+  h->complete = complete && n == len;
+  h->retained = rxRetain;
+  h->topicId = (int8_t)rxTopicId;
+  h->len = (uint16_t)n;
+  std::memcpy(h->topic, rxTopic, sizeof(h->topic));
+  std::memcpy(h->payload, data, n);
+  h->payload[n] = '\0';
+
+  scheduleFlush(admitted ? 1U : 1000U / l.rate + 1U);
+}
+
+// Ingest lock held.
+void StateMQEsp::scheduleFlush(uint32_t delay_ms) {
+  if (flushTimer == INVALID_ONESHOT) {
+    flushTimer = scheduleJob(JOB_RATE_FLUSH, delay_ms, &StateMQEsp::rate_flush);
+  }
+}
+
+void StateMQEsp::rate_flush(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (self) self->flushHeld();
+}
+
+// Timer task. Releases held messages in arrival order while their buckets
+// have tokens; the rest wait for the next flush. Each message is copied out
+// and delivered with only the delivery lock held: user callbacks may
+// publish, and the MQTT task holds the client's API lock while it waits
+// for the ingest lock.
+void StateMQEsp::flushHeld() {
+  HeldMsg out;
+
+  xSemaphoreTake(ingestLock, portMAX_DELAY);
+  flushTimer = INVALID_ONESHOT;
+
+  const uint32_t now = uptime_ms();
+  for (size_t i = 0; i < MAX_RATE_LIMITS + 1; ++i) {
+    if (limits[i].rate) refill(limits[i], now);
+  }
+
+  while (takeHeld(out)) {
+    xSemaphoreGive(ingestLock);
+
+    xSemaphoreTake(deliverLock, portMAX_DELAY);
+    deliverMessage(out.topicId, out.topic, out.payload, out.len, out.complete, out.retained);
+    xSemaphoreGive(deliverLock);
+
+    xSemaphoreTake(ingestLock, portMAX_DELAY);
+  }
+  xSemaphoreGive(ingestLock);
+}
+
+// Ingest lock held. Moves the oldest releasable message into `out` and
+// charges its buckets; when none is releasable, schedules the next flush.
+bool StateMQEsp::takeHeld(HeldMsg& out) {
+  uint32_t next = 0;
+
+  size_t i = 0;
+  while (i < heldCount) {
+    HeldMsg& h = held[i];
+
+    if (h.admitted) break;
+
+    RateLimit* tl = nullptr;
+    if (h.topicId >= 0 && topics[h.topicId].limit) tl = &limits[topics[h.topicId].limit];
+    if (tl && tl->rate == 0) tl = nullptr;
+    RateLimit* gl = limits[0].rate ? &limits[0] : nullptr;
+
+    RateLimit* empty = nullptr;
+    if (tl && tl->tokens < 1000) empty = tl;
+    else if (gl && gl->tokens < 1000) empty = gl;
+
+    if (empty) {
+      const uint32_t wait = 1000U / empty->rate + 1U;
+      if (!next || wait < next) next = wait;
+      ++i;
+      continue;
+    }
+
+    if (tl) { tl->tokens -= 1000; tl->stats.accepted++; }
+    if (gl) { gl->tokens -= 1000; gl->stats.accepted++; }
+    break;
+  }
+
+  if (i == heldCount) {
+    if (heldCount) scheduleFlush(next ? next : 1);
+    return false;
+  }
+
+  out = held[i];
+  for (size_t j = i + 1; j < heldCount; ++j) held[j - 1] = held[j];
+  heldCount--;
+  return true;
+}
+
+// Raw subscribe
+
+int StateMQEsp::rawIndex(const char* topic) const {
+  if (!topic) return -1;
+
+  int id = topicFind(topic, topicHash(topic));
+  if (id < 0 || !topics[id].raw) return -1;
+  return topics[id].raw - 1;
+}
+
+StateMQEsp::RawSlot* StateMQEsp::rawSlot(RawHandle h) {
+  return (h.index < rawCount) ? &raw[h.index] : nullptr;
+}
+
+StateMQEsp::RawHandle StateMQEsp::subscribe(const char* topic, int qos) {
+  if (!topic || !*topic) return RawHandle{};
+
+  qos = clamp_qos(qos);
+
+  const int id = topicIntern(topic);
+  if (id < 0) return RawHandle{};
+
+  TopicEntry& t = topics[id];
+  int idx = (int)t.raw - 1;
+  if (idx < 0) {
+    if (rawCount >= MAX_RAW_SUBS) return RawHandle{};
+
+    RawSlot& s = raw[rawCount];
+    s.topic = t.name;
+    resetLatest(s);
+
+    if (isWildcard(s.topic) && !trieInsert(s.topic, rawCount)) {
+      s.topic = nullptr;
+      return RawHandle{};
+    }
+
+    idx = (int)rawCount;
+    rawCount++;
+    t.raw = (uint8_t)rawCount;
+  }
+
+  t.qos = (int8_t)qos;
+
+  // If already connected, subscribe immediately.
+  if (mqttConnected && client) {
+    esp_mqtt_client_subscribe(client, topic, qos);
+  }
+
+  return RawHandle{(uint8_t)idx};
+}
+
+// Push-style raw subscribe
+
+StateMQEsp::RawHandle StateMQEsp::subscribe(const char* topic, int qos, RawCallback callback,
+                                            void* user, bool deferred) {
+  if (!callback) return RawHandle{};
+
+  RawHandle h = subscribe(topic, qos);
+  if (!h) return h;
+
+  RawSlot& s = raw[h.index];
+  s.cbUser = user;
+  s.cbDeferred = deferred;
+  s.cb = callback;
+
+  if (deferred) {
+    rxDeferredUsed = true;
+    if (started) startRxDispatcher();
+  }
+  return h;
+}
+
+uint32_t StateMQEsp::callbackDrops() const {
+  return rxDrops.load(std::memory_order_relaxed);
+}
+
+void StateMQEsp::startRxDispatcher() {
+  if (rxTask) return;
+
+  if (!rxQueue) {
+    rxQueue = xQueueCreateStatic(RX_QUEUE_DEPTH, sizeof(RxItem), rxQueueStorage, &rxQueueBuf);
+    if (!rxQueue) return;
+  }
+
+#if STATEMQ_STATIC_TASKS
+  rxTask = xTaskCreateStatic(rx_dispatch_task, "statemq_rx",
+                             STACK_RX_BYTES / sizeof(StackType_t),
+                             this, 1, rxStack, &rxTcb);
+#else
+  xTaskCreate(rx_dispatch_task, "statemq_rx", STACK_RX_BYTES / sizeof(StackType_t),
+              this, 1, &rxTask);
+#endif
+}
+
+void StateMQEsp::rx_dispatch_task(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (!self) vTaskDelete(nullptr);
+
+  RxItem& item = self->rxItem;  // kept off the task stack
+  for (;;) {
+    if (xQueueReceive(self->rxQueue, &item, portMAX_DELAY) != pdTRUE) continue;
+    if (item.index >= self->rawCount) continue;
+
+    const RawSlot& s = self->raw[item.index];
+    if (s.cb) s.cb(item.topic, item.payload, item.len, s.cbUser);
+  }
+}
+
+// Called on the MQTT task with a complete (possibly truncated) message.
+void StateMQEsp::deliverRaw(size_t index, const char* topic, const char* data, size_t len) {
+  RawSlot& s = raw[index];
+  if (!s.cb) return;
+
+  if (!s.cbDeferred) {
+    s.cb(topic, data, len, s.cbUser);
+    return;
+  }
+
+  if (!rxQueue) {
+    rxDrops.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  RxItem& item = rxSendItem;
+  item.index = (uint8_t)index;
+  std::strncpy(item.topic, topic, RAW_TOPIC_LEN);
+  item.topic[RAW_TOPIC_LEN - 1] = '\0';
+  item.len = (uint16_t)((len < RAW_PAYLOAD_LEN - 1) ? len : RAW_PAYLOAD_LEN - 1);
+  std::memcpy(item.payload, data, item.len);
+  item.payload[item.len] = '\0';
+
+  if (xQueueSend(rxQueue, &item, 0) != pdTRUE) {
+    rxDrops.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// Wildcard filters
+
+bool StateMQEsp::isWildcard(const char* topic) {
+  return std::strchr(topic, '+') || std::strchr(topic, '#');
+}
+
+// Walks/extends the trie one level at a time. '+' must be a whole level,
+// '#' a whole last level.
+bool StateMQEsp::trieInsert(const char* filter, size_t index) {
+  size_t node = 0;
+  const char* p = filter;
+
+  for (;;) {
+    const char* end = std::strchr(p, '/');
+    const size_t len = end ? (size_t)(end - p) : std::strlen(p);
+
+    if (len == 1 && p[0] == '#') {
+      if (end) return false;
+      trie[node].multi = (uint8_t)(index + 1);
+      return true;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      if ((p[i] == '+' || p[i] == '#') && len != 1) return false;
+    }
+    if (len > UINT8_MAX) return false;
+
+    size_t c = trie[node].child;
+    while (c) {
+      const TrieNode& n = trie[c - 1];
+      if (n.len == len && std::strncmp(n.level, p, len) == 0) break;
+      c = n.sibling;
+    }
+
+    if (!c) {
+      if (trieCount >= MAX_TRIE_NODES) return false;
+      TrieNode& n = trie[trieCount];
+      n = TrieNode{p, (uint8_t)len, 0, trie[node].child, 0, 0};
+      trie[node].child = (uint8_t)(trieCount + 1);
+      c = ++trieCount;
+    }
+
+    node = c - 1;
+    if (!end) {
+      trie[node].exact = (uint8_t)(index + 1);
+      return true;
+    }
+    p = end + 1;
+  }
+}
+
+// level points at the current topic level inside `topic`. Per MQTT,
+// wildcards at the first level do not match topics starting with '$',
+// and "a/#" also matches "a".
+void StateMQEsp::trieMatch(size_t node, const char* level, bool root, const char* topic,
+                           const char* data, size_t len) {
+  const TrieNode& n = trie[node];
+  const bool sys = root && level[0] == '$';
+
+  if (n.multi && !sys) storeRaw(n.multi - 1, topic, data, len);
+
+  const char* end = std::strchr(level, '/');
+  const size_t llen = end ? (size_t)(end - level) : std::strlen(level);
+
+  for (size_t c = n.child; c; c = trie[c - 1].sibling) {
+    const TrieNode& ch = trie[c - 1];
+    const bool plus = (ch.len == 1 && ch.level[0] == '+');
+    if (plus ? sys : !(ch.len == llen && std::strncmp(ch.level, level, llen) == 0)) continue;
+
+    if (end) {
+      trieMatch(c - 1, end + 1, false, topic, data, len);
+    } else {
+      if (ch.exact) storeRaw(ch.exact - 1, topic, data, len);
+      if (ch.multi) storeRaw(ch.multi - 1, topic, data, len);
+    }
+  }
+}
+
+// Queued raw subscribe
+
+StateMQEsp::RawHandle StateMQEsp::subscribe(const char* topic, int qos, size_t depth, size_t maxLen) {
+  if (depth == 0 || maxLen == 0 || maxLen >= RAW_PAYLOAD_LEN) return RawHandle{};
+  if (depth > UINT16_MAX) return RawHandle{};
+
+  const size_t stride = maxLen + 3;
+  const size_t bytes = (stride * depth + 3U) & ~(size_t)3U;
+
+  // An existing queued subscription is reused as is.
+  const int existing = topic ? rawIndex(topic) : -1;
+  if (existing >= 0 && raw[existing].ring) {
+    const RawSlot& s = raw[existing];
+    if (s.depth != depth || (size_t)s.stride != stride) return RawHandle{};
+    return subscribe(topic, qos);
+  }
+
+  // Reserve the ring before subscribing, so a full pool never leaves an
+  // active subscription without its queue.
+  if (bytes > MAILBOX_POOL_BYTES - mailboxUsed) return RawHandle{};
+  uint8_t* ring = mailboxPool + mailboxUsed;
+  mailboxUsed += bytes;
+
+  RawHandle h = subscribe(topic, qos);
+  if (!h) {
+    mailboxUsed -= bytes;
+    return h;
+  }
+
+  RawSlot& s = raw[h.index];
+  s.depth = (uint16_t)depth;
+  s.stride = (uint16_t)stride;
+  s.head.store(0, std::memory_order_relaxed);
+  s.tail.store(0, std::memory_order_relaxed);
+  s.dropped.store(0, std::memory_order_relaxed);
+  s.ring = ring;
+  return h;
+}
+
+// Producer side (MQTT task). Drops the new message when full: the tail
+// belongs to the reader, so the writer never overwrites unread records.
+void StateMQEsp::ringPush(RawSlot& s, const char* data, size_t len) {
+  const uint32_t head = s.head.load(std::memory_order_relaxed);
+  const uint32_t tail = s.tail.load(std::memory_order_acquire);
+  if (head - tail >= s.depth) {
+    s.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  const size_t maxLen = (size_t)s.stride - 3;
+  if (len > maxLen) len = maxLen;
+
+  uint8_t* rec = s.ring + (size_t)(head % s.depth) * s.stride;
+  const uint16_t l = (uint16_t)len;
+  std::memcpy(rec, &l, sizeof(l));
+  std::memcpy(rec + 2, data, len);
+  rec[2 + len] = '\0';
+
+  s.head.store(head + 1, std::memory_order_release);
+}
+
+const char* StateMQEsp::peek(const char* topic, size_t* len) {
+  int idx = rawIndex(topic);
+  if (idx < 0) return nullptr;
+  return peek(RawHandle{(uint8_t)idx}, len);
+}
+
+bool StateMQEsp::pop(const char* topic) {
+  int idx = rawIndex(topic);
+  if (idx < 0) return false;
+  return pop(RawHandle{(uint8_t)idx});
+}
+
+const char* StateMQEsp::peek(RawHandle h, size_t* len) {
+  RawSlot* s = rawSlot(h);
+  if (!s || !s->ring) return nullptr;
+
+  const uint32_t tail = s->tail.load(std::memory_order_relaxed);
+  if (s->head.load(std::memory_order_acquire) == tail) return nullptr;
+
+  const uint8_t* rec = s->ring + (size_t)(tail % s->depth) * s->stride;
+  if (len) {
+    uint16_t l;
+    std::memcpy(&l, rec, sizeof(l));
+    *len = l;
+  }
+  return (const char*)(rec + 2);
+}
+
+bool StateMQEsp::pop(RawHandle h) {
+  RawSlot* s = rawSlot(h);
+  if (!s || !s->ring) return false;
+
+  const uint32_t tail = s->tail.load(std::memory_order_relaxed);
+  if (s->head.load(std::memory_order_acquire) == tail) return false;
+
+  s->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+uint32_t StateMQEsp::overflows(const char* topic) const {
+  int idx = rawIndex(topic);
+  if (idx < 0) return 0;
+  return raw[(size_t)idx].dropped.load(std::memory_order_relaxed);
+}
+
+// Streaming subscribe
+
+bool StateMQEsp::subscribeStream(const char* topic, int qos, StreamSink sink, void* user) {
+  if (!topic || !*topic || !sink) return false;
+
+  qos = clamp_qos(qos);
+
+  const int id = topicIntern(topic);
+  if (id < 0) return false;
+
+  TopicEntry& t = topics[id];
+  int idx = (int)t.stream - 1;
+  if (idx < 0) {
+    if (streamCount >= MAX_STREAM_SUBS) return false;
+    idx = (int)streamCount;
+    streams[idx].topic = t.name;
+  }
+
+  // sink is written before the slot becomes visible to the MQTT task
+  streams[idx].sink = sink;
+  streams[idx].user = user;
+  if ((size_t)idx == streamCount) {
+    streamCount++;
+    t.stream = (uint8_t)streamCount;
+  }
+
+  t.qos = (int8_t)qos;
+
+  if (mqttConnected && client) {
+    esp_mqtt_client_subscribe(client, topic, qos);
+  }
+
+  return true;
+}
+
+const char* StateMQEsp::msg(const char* topic, size_t* len) {
+  if (!topic || !*topic) return nullptr;
+
+  int idx = rawIndex(topic);
+  if (idx < 0) return nullptr;
+
+  return msg(RawHandle{(uint8_t)idx}, len);
+}
+
+// Reader side: trade the buffer we hold for the freshest one.
+const char* StateMQEsp::msg(RawHandle h, size_t* len) {
+  RawSlot* s = rawSlot(h);
+  if (!s) return nullptr;
+  if (!(s->latest.load(std::memory_order_relaxed) & LATEST_FRESH)) return nullptr;
+
+  const uint8_t prev = s->latest.exchange(s->rd, std::memory_order_acq_rel);
+  s->rd = prev & 3U;
+
+  if (len) *len = s->bufLen[s->rd];
+  return s->buf[s->rd];
+}
+
+void StateMQEsp::resetLatest(RawSlot& s) {
+  for (size_t i = 0; i < 3; ++i) {
+    s.buf[i][0] = '\0';
+    s.bufLen[i] = 0;
+  }
+  s.wr = 0;
+  s.latest.store(1, std::memory_order_relaxed);
+  s.rd = 2;
+}
+
+// Lifecycle
+
+void StateMQEsp::cleanup(bool disconnect_wifi, bool clear_config) {
+  stopMqtt();
+  abortSync();
+
+  wifiHasIp = false;
+  mqttConnected = false;
+  rxActive = false;
+  core.setConnected(false);
+
+  if (stackProfileTask) {
+    vTaskDelete(stackProfileTask);
+    stackProfileTask = nullptr;
+  }
+
+  if (oneShotTask) {
+    vTaskDelete(oneShotTask);
+    oneShotTask = nullptr;
+  }
+
+  if (rxTask) {
+    vTaskDelete(rxTask);
+    rxTask = nullptr;
+  }
+  started = false;
+
+  // stop user tasks
+  for (size_t i = 0; i < taskHandlesCount; ++i) {
+    releaseTask((TaskHandle_t)taskHandles[i]);
+    taskHandles[i] = nullptr;
+    taskCtxs[i] = nullptr;
+  }
+
+  taskHandlesCount = 0;
+
+
+  freestr(wifiSsid);
+  freestr(wifiPass);
+  freestr(brokerUri);
+
+  if (clear_config) {
+    // drop pending one-shots; outstanding ids become stale
+    portENTER_CRITICAL(&oneShotMux);
+    while (oneShotCount > 0) heapRemove(oneShotCount - 1);
+    portEXIT_CRITICAL(&oneShotMux);
+
+    freestr(stateTopic);
+    clearLastWill();
+    rawCount = 0;
+    for (size_t i = 0; i < MAX_RAW_SUBS; ++i) {
+      raw[i].topic = nullptr;
+      resetLatest(raw[i]);
+      raw[i].ring = nullptr;
+      raw[i].depth = 0;
+      raw[i].stride = 0;
+      raw[i].cb = nullptr;
+      raw[i].cbUser = nullptr;
+      raw[i].cbDeferred = false;
+    }
+    rxDeferredUsed = false;
+    resetTopics();
+    dedupWindowMs = 0;
+    dupSuppressed.store(0, std::memory_order_relaxed);
+    syncTimeoutMs = 0;
+    syncCollapsed.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < MAX_RATE_LIMITS + 1; ++i) limits[i] = RateLimit{};
+    limitCount = 0;
+    heldCount = 0;
+    cancelSlot(flushTimer, ONESHOT_SLOTS);
+    flushTimer = INVALID_ONESHOT;
+    rateLimited = false;
+    setOfflineQueue(0, 0);
+    offlineCounters = OfflineStats{};
+    replayScheduled = false;
+    durable.close();
+    durableCount = 0;
+    durablePumping = false;
+    durableSending = false;
+    durableKick = false;
+    durableRewind = false;
+    durableDeferred = false;
+    for (size_t i = 0; i < COALESCE_SLOTS; ++i) coalesceSlots[i] = CoalesceSlot{};
+    coalesceCount = 0;
+    coalesceArmed = false;
+    coalesceCounters = CoalesceStats{};
+    statePubHead = 0;
+    statePubCount = 0;
+    statePubArmed = false;
+    statePubSchema = false;
+    aliasMax = 0;
+    for (AliasSlot& s : aliasSlots) s = AliasSlot{};
+    compressTopics = 0;
+    compressCounters = CompressStats{};
+    for (size_t i = 0; i < MAX_TRIE_NODES; ++i) trie[i] = TrieNode{};
+    trieCount = 1;
+    mailboxUsed = 0;
+    streamCount = 0;
+    for (size_t i = 0; i < MAX_STREAM_SUBS; ++i) {
+      streams[i] = StreamSlot{};
+    }
+    StatePublishTopic("", -1, false);
+    StatePublishFormat(StatePubFormat::Json);
+  }
+
+
+  if (disconnect_wifi) {
+    esp_wifi_disconnect();
+    esp_wifi_stop();
+  }
+}
+
+void StateMQEsp::end(bool disconnect_wifi) {
+  cleanup(disconnect_wifi, true);
+}
+
+//public current and previous state upon transition
+void StateMQEsp::StatePublishTopic(const char* topic, int qos, bool enable, bool retain) {
+  freestr(stateTopic);
+  stateTopic = dupstr(topic ? topic : "");
+  statePubQos = qos;
+  statePubEnabled = enable && (stateTopic && stateTopic[0]);
+  statePubRetain = retain;
+
+  hasLastStatePub = false;
+  lastStatePub = StateMQ::OFFLINE_ID;
+}
+
+
+
+bool StateMQEsp::begin(const char* wifi_ssid,
+                       const char* wifi_pass,
+                       const char* broker_uri)
+{
+  cleanup(false, false);
+
+  if (!wifi_ssid || !broker_uri) return false;
+
+  wifiSsid   = dupstr(wifi_ssid);
+  wifiPass   = dupstr(wifi_pass ? wifi_pass : "");
+  brokerUri  = dupstr(broker_uri);
+
+  if (!wifiSsid || !wifiPass || !brokerUri) {
+    end(false);
+    return false;
+  }
+
+  core.setConnected(false);
+
+  // ---- init WiFi  ----
+  ESP_ERROR_CHECK(nvs_flash_init());
+  ESP_ERROR_CHECK(esp_netif_init());
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  esp_netif_create_default_wifi_sta();
+
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(
+      WIFI_EVENT, ESP_EVENT_ANY_ID, &StateMQEsp::wifi_event_handler, this, nullptr));
+
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(
+      IP_EVENT, IP_EVENT_STA_GOT_IP, &StateMQEsp::wifi_event_handler, this, nullptr));
+
+  wifi_config_t wc{};
+  std::memset(&wc, 0, sizeof(wc));
+  std::strncpy((char*)wc.sta.ssid, wifiSsid, sizeof(wc.sta.ssid));
+  std::strncpy((char*)wc.sta.password, wifiPass, sizeof(wc.sta.password));
+  wc.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wc));
+  ESP_ERROR_CHECK(esp_wifi_start());
+
+  ESP_LOGI(TAG_WIFI, "WiFi start -> connecting...");
+  ESP_ERROR_CHECK(esp_wifi_connect());
+
+  // keep an application callback registered before begin()
+  void* appUser = nullptr;
+  auto appCb = core.stateChangeCallback(&appUser);
+  if (appCb != &StateMQEsp::on_state_change_trampoline) {
+    appStateCb = appCb;
+    appStateUser = appUser;
+  }
+
+  buildStateFrags();
+  core.onStateChange(&StateMQEsp::on_state_change_trampoline, this);
+
+  // ---- start tasks ----
+  taskHandlesCount = core.taskCount();
+  if (taskHandlesCount > MAX_USER_TASKS) taskHandlesCount = MAX_USER_TASKS;
+
+  for (size_t i = 0; i < taskHandlesCount; ++i) {
+    const TaskDef& t = core.task(i);
+
+    UserTaskCtx* ctx = &taskCtxPool[i];
+    *ctx = UserTaskCtx{t.callback, t.callbackEx, t.user, t.period_ms};
+    ctx->cbEdge = t.callbackEdge;
+
+    const bool edge = (t.trigger == TaskTrigger::Transition);
+
+    uint32_t stackBytes = stackBytesFor(t);
+    ctx->name = t.name;
+    ctx->owner = this;
+    ctx->id = i;
+    ctx->budgetUs = t.budget_us;
+    ctx->slackTicks = pdMS_TO_TICKS(t.slack_ms);
+
+    if (alignTicks) {
+      // start on the next grid point; phase is relative to the grid
+      const TickType_t now = xTaskGetTickCount();
+      ctx->alignIdeal = (TickType_t)(now + (alignTicks - now % alignTicks) - pdMS_TO_TICKS(t.period_ms));
+      ctx->alignPhase = (TickType_t)((alignTicks - pdMS_TO_TICKS(t.period_ms) % alignTicks) % alignTicks);
+    }
+
+    // ctx is published before the task can run
+    taskCtxs[i] = ctx;
+
+    TaskHandle_t handle = createTask(
+        edge ? edge_task_trampoline : user_task_trampoline,
+        t.name ? t.name : "statemq_task",
+        stackBytes,
+        ctx);
+
+    if (!handle) {
+      ESP_LOGE(TAG_TASK, "task %s not created (%u B stack)",
+               t.name ? t.name : "statemq_task", (unsigned)stackBytes);
+      taskCtxs[i] = nullptr;
+      continue;
+    }
+
+    ctx->stackBytes = stackBytes;
+    taskHandles[i] = handle;
+
+    if (!t.enabled && handle) {
+      vTaskSuspend(handle);
+    }
+  }
+
+  started = true;
+  if (rxDeferredUsed) startRxDispatcher();
+
+#if STATEMQ_STATIC_TASKS
+  oneShotTask = xTaskCreateStatic(oneshot_task, "statemq_timer",
+                                  STACK_TIMER_BYTES / sizeof(StackType_t),
+                                  this, 1, timerStack, &timerTcb);
+#else
+  xTaskCreate(oneshot_task, "statemq_timer", STACK_TIMER_BYTES / sizeof(StackType_t),
+              this, 1, &oneShotTask);
+#endif
+
+  if (stackProfilePeriodMs > 0) {
+#if STATEMQ_STATIC_TASKS
+    stackProfileTask = xTaskCreateStatic(stack_profile_task, "statemq_prof",
+                                         STACK_PROFILE_BYTES / sizeof(StackType_t),
+                                         this, 1, profileStack, &profileTcb);
+#else
+    xTaskCreate(stack_profile_task, "statemq_prof", STACK_PROFILE_BYTES / sizeof(StackType_t),
+                this, 1, &stackProfileTask);
+#endif
+  }
+
+  return true;
+}
+
+
+// Runtime
+
+bool StateMQEsp::connected() const {
+  return mqttConnected;
+}
+
+bool StateMQEsp::publish(const char* topic,
+                         const char* payload,
+                         int qos,
+                         bool retain,
+                         uint8_t priority) {
+  if (!topic || !topic[0]) return false;
+
+  int q = (qos < 0) ? defaultPubQos : qos;
+  q = clamp_qos(q);
+
+  const char* msg = payload ? payload : "";
+
+  // queue behind an unsent backlog to keep order; the MQTT task also
+  // queues while another task is inside an aliased send
+  if (offlineMaxMsgs && (!client || !mqttConnected || offlineCount || aliasBusy())) {
+    return offlinePush(topic, msg, q, retain, priority);
+  }
+  if (!client || !mqttConnected) return false;
+
+  int msg_id = sendMessage(topic, msg, q, retain, false);
+  return msg_id >= 0;
+}
+
+// Compression
+
+bool StateMQEsp::setCompression(const char* topic, bool enable) {
+#if STATEMQ_COMPRESSION
+  if (!topic || !topic[0] || isWildcard(topic)) return false;
+  if (!zLock) zLock = xSemaphoreCreateMutexStatic(&zLockBuf);
+  if (!zLock) return false;
+
+  const int id = topicIntern(topic);
+  if (id < 0) return false;
+
+  TopicEntry& t = topics[id];
+  if (t.compress != enable) {
+    t.compress = enable;
+    if (enable) compressTopics++;
+    else compressTopics--;
+  }
+  return true;
+#else
+  (void)topic;
+  (void)enable;
+  return false;
+#endif
+}
+
+StateMQEsp::CompressStats StateMQEsp::compressStats() const {
+  return compressCounters;
+}
+
+// publish() and offline replay: compression first, then aliases.
+int StateMQEsp::sendMessage(const char* topic, const char* msg, int qos, bool retain,
+                            bool enqueue) {
+#if STATEMQ_COMPRESSION
+  const size_t len = compressTopics ? std::strlen(msg) : 0;
+  const int tid = (len >= COMPRESS_MIN) ? topicFind(topic, topicHash(topic)) : -1;
+
+  // the MQTT task never waits for zLock (see sendPublish)
+  const bool onMqttTask = xTaskGetCurrentTaskHandle() == mqttTask;
+  if (tid >= 0 && topics[tid].compress &&
+      xSemaphoreTake(zLock, onMqttTask ? 0 : portMAX_DELAY) == pdTRUE) {
+    const size_t n = compress::compress(msg, len, zOut, sizeof(zOut), zWork);
+    int id = -2;
+    if (n) {
+      id = sendPublish(topic, reinterpret_cast<const char*>(zOut), (int)n, qos, retain, enqueue);
+      if (id >= 0) {
+        compressCounters.compressed++;
+        compressCounters.plainBytes += (uint32_t)len;
+        compressCounters.wireBytes += (uint32_t)n;
+      }
+    }
+    xSemaphoreGive(zLock);
+    if (id != -2) return id;
+  }
+#endif
+
+  if (aliasMax && qos == 0 && !enqueue) return sendAliased(topic, msg, qos, retain);
+  return sendPublish(topic, msg, 0, qos, retain, enqueue);
+}
+
+// Topic aliases
+
+bool StateMQEsp::setTopicAliases(uint16_t max_aliases) {
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+  if (client || max_aliases > MAX_TOPIC_ALIASES) return false;
+  if (!aliasLock) aliasLock = xSemaphoreCreateMutexStatic(&aliasLockBuf);
+  if (!aliasLock) return false;
+
+  for (AliasSlot& s : aliasSlots) s = AliasSlot{};
+  aliasMax = max_aliases;
+  return true;
+#else
+  (void)max_aliases;
+  return false;
+#endif
+}
+
+uint32_t StateMQEsp::aliasedPublishes() const {
+  return aliasSent;
+}
+
+int StateMQEsp::sendPublish(const char* topic, const char* data, int len, int qos, bool retain,
+                            bool enqueue) {
+  if (!aliasMax) {
+    return enqueue ? esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true)
+                   : esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+  }
+
+  // The MQTT task may be holding the client lock that an aliased send
+  // waits on, so it never takes aliasLock; it sends only while no
+  // aliased send is active (see aliasBusy()).
+  if (xTaskGetCurrentTaskHandle() == mqttTask) {
+    if (aliasActive.load(std::memory_order_acquire)) return -1;
+    return enqueue ? esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true)
+                   : esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+  }
+
+  xSemaphoreTake(aliasLock, portMAX_DELAY);
+  const int id = enqueue ? esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true)
+                         : esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+  xSemaphoreGive(aliasLock);
+  return id;
+}
+
+// True on the MQTT task while another task is inside an aliased send, when
+// the client's publish property may carry that task's alias. aliasActive
+// is raised before the property is set and dropped after it is cleared,
+// and setting it needs the client lock this task holds while dispatching,
+// so a false answer holds until the event handler returns.
+bool StateMQEsp::aliasBusy() const {
+  return aliasMax && xTaskGetCurrentTaskHandle() == mqttTask &&
+         aliasActive.load(std::memory_order_acquire);
+}
+
+// aliasLock held. Returns the slot tracking `topic` this session, or
+// takes over a free one, else the least published one (the newest on a
+// tie, so one-off topics replace each other rather than the steady
+// ones). Counts halve every ALIAS_AGE_EVICTIONS takeovers so a topic
+// that stopped being published gives way. Alias numbers above aliasCap
+// are never handed out; aliasCap on no slot left.
+size_t StateMQEsp::aliasSlot(const char* topic, size_t len, uint32_t hash) {
+  size_t victim = aliasCap;
+  bool   live = true;
+
+  for (size_t i = 0; i < aliasCap; ++i) {
+    AliasSlot& s = aliasSlots[i];
+    if (s.session != aliasSession) {
+      if (live) victim = i;
+      live = false;
+      continue;
+    }
+    if (s.hash == hash && std::strcmp(s.topic, topic) == 0) return i;
+    if (!live) continue;
+
+    const AliasSlot* v = (victim == aliasCap) ? nullptr : &aliasSlots[victim];
+    if (!v || s.pubs < v->pubs || (s.pubs == v->pubs && s.lastUse > v->lastUse)) victim = i;
+  }
+  if (victim == aliasCap) return aliasCap;
+
+  if (live && ++aliasEvictions % ALIAS_AGE_EVICTIONS == 0) {
+    for (size_t i = 0; i < aliasCap; ++i) aliasSlots[i].pubs >>= 1;
+  }
+
+  // the alias is registered again, for this topic, before it is used
+  AliasSlot& s = aliasSlots[victim];
+  std::memcpy(s.topic, topic, len + 1);
+  s.hash = hash;
+  s.session = aliasSession;
+  s.pubs = 0;
+  s.registered = false;
+  return victim;
+}
+
+// QoS 0 publish() only: a QoS 1/2 message can be resent on a later
+// connection, where an alias-only topic would be a protocol error.
+int StateMQEsp::sendAliased(const char* topic, const char* data, int qos, bool retain) {
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+  if (xTaskGetCurrentTaskHandle() == mqttTask) return sendPublish(topic, data, 0, qos, retain, false);
+
+  const size_t len = std::strlen(topic);
+  if (len >= RAW_TOPIC_LEN) return sendPublish(topic, data, 0, qos, retain, false);
+  const uint32_t hash = topicHash(topic);
+
+  xSemaphoreTake(aliasLock, portMAX_DELAY);
+
+  const size_t i = aliasSlot(topic, len, hash);
+  if (i == aliasCap) {
+    xSemaphoreGive(aliasLock);
+    return sendPublish(topic, data, 0, qos, retain, false);
+  }
+
+  AliasSlot& s = aliasSlots[i];
+  s.lastUse = ++aliasClock;
+  if (s.pubs < 0xFF) s.pubs++;
+
+  // alias-only once registered; registering sends topic and alias together
+  const char* wireTopic = s.registered ? "" : topic;
+  uint16_t alias = (s.registered || s.pubs > ALIAS_AFTER) ? (uint16_t)(i + 1) : 0;
+  const bool registering = alias && !s.registered;
+
+  const esp_mqtt5_publish_property_config_t none{};
+  if (alias) {
+    esp_mqtt5_publish_property_config_t prop{};
+    prop.topic_alias = alias;
+    aliasActive.store(true, std::memory_order_release);
+    if (esp_mqtt5_client_set_publish_property(client, &prop) != ESP_OK) {
+      // above the broker's Topic Alias Maximum; this slot and the ones
+      // after it stay unused for the session
+      aliasCap = (uint16_t)i;
+      s.session = 0;
+      alias = 0;
+      wireTopic = topic;
+      esp_mqtt5_client_set_publish_property(client, &none);
+      aliasActive.store(false, std::memory_order_release);
+    }
+  }
+
+  const int id = esp_mqtt_client_publish(client, wireTopic, data, 0, qos, retain);
+
+  if (alias) {
+    // the client keeps the property for every later publish
+    esp_mqtt5_client_set_publish_property(client, &none);
+    aliasActive.store(false, std::memory_order_release);
+  }
+
+  if (id >= 0 && alias && registering) s.registered = true;
+  if (id >= 0 && alias) aliasSent++;
+
+  xSemaphoreGive(aliasLock);
+  return id;
+#else
+  return sendPublish(topic, data, 0, qos, retain, false);
+#endif
+}
+
+// Offline queue
+
+bool StateMQEsp::setOfflineQueue(size_t maxMessages, size_t maxBytes,
+                                 OfflinePolicy policy, uint16_t replayMs) {
+  if (maxMessages > OFFLINE_MAX_MSGS || maxBytes > OFFLINE_POOL_BYTES) return false;
+  if (!offlineLock) offlineLock = xSemaphoreCreateMutexStatic(&offlineLockBuf);
+
+  xSemaphoreTake(offlineLock, portMAX_DELAY);
+  offlineMaxMsgs = maxMessages;
+  offlineMaxBytes = maxBytes;
+  offlinePolicy = policy;
+  replayIntervalMs = replayMs;
+  if (!maxMessages) {
+    offlineCount = 0;
+    offlineUsed = 0;
+    replayHeadBusy = false;
+  }
+  xSemaphoreGive(offlineLock);
+  return true;
+}
+
+StateMQEsp::OfflineStats StateMQEsp::offlineStats() const {
+  if (!offlineLock) return offlineCounters;
+
+  xSemaphoreTake(offlineLock, portMAX_DELAY);
+  OfflineStats out = offlineCounters;
+  out.depth = (uint16_t)offlineCount;
+  out.bytes = (uint16_t)offlineUsed;
+  xSemaphoreGive(offlineLock);
+  return out;
+}
+
+// offlineLock held. Closes the gap left by record i.
+void StateMQEsp::offlineRemove(size_t i) {
+  const OfflineMsg m = offlineMsgs[i];
+  std::memmove(offlinePool + m.offset, offlinePool + m.offset + m.size,
+               offlineUsed - m.offset - m.size);
+  offlineUsed -= m.size;
+
+  for (size_t j = i + 1; j < offlineCount; ++j) {
+    offlineMsgs[j - 1] = offlineMsgs[j];
+    offlineMsgs[j - 1].offset -= m.size;
+  }
+  offlineCount--;
+}
+
+bool StateMQEsp::offlinePush(const char* topic, const char* payload, int qos, bool retain,
+                             uint8_t priority) {
+  const size_t tlen = std::strlen(topic);
+  const size_t size = tlen + 1 + std::strlen(payload) + 1;
+
+  bool ok = true;
+  bool kick = false;
+
+  xSemaphoreTake(offlineLock, portMAX_DELAY);
+  if (size > OFFLINE_RECORD_MAX || size > offlineMaxBytes) {
+    ok = false;
+  }
+
+  // the head is never evicted while the replayer is sending it
+  const size_t first = replayHeadBusy ? 1 : 0;
+
+  while (ok && (offlineCount >= offlineMaxMsgs || offlineUsed + size > offlineMaxBytes)) {
+    size_t victim = offlineCount;
+
+    if (offlinePolicy == OfflinePolicy::DropOldest) {
+      if (first < offlineCount) victim = first;
+    } else if (offlinePolicy == OfflinePolicy::DropLowest) {
+      for (size_t i = first; i < offlineCount; ++i) {
+        if (offlineMsgs[i].priority > priority) continue;
+        if (victim == offlineCount || offlineMsgs[i].priority < offlineMsgs[victim].priority) {
+          victim = i;
+        }
+      }
+    }
+
+    if (victim == offlineCount) {
+      ok = false;
+      break;
+    }
+    offlineRemove(victim);
+    offlineCounters.dropped++;
+  }
+
+  if (ok) {
+    OfflineMsg& m = offlineMsgs[offlineCount++];
+    m = OfflineMsg{(uint16_t)offlineUsed, (uint16_t)size, (uint16_t)tlen,
+                   (uint8_t)qos, priority, retain};
+    std::memcpy(offlinePool + offlineUsed, topic, tlen + 1);
+    std::memcpy(offlinePool + offlineUsed + tlen + 1, payload, size - tlen - 1);
+    offlineUsed += size;
+    offlineCounters.queued++;
+
+    // connected with a backlog that is not being drained (e.g. queued
+    // from another task after the replayer went idle)
+    if (client && mqttConnected && !replayScheduled) {
+      replayScheduled = true;
+      kick = true;
+    }
+  } else {
+    offlineCounters.dropped++;
+  }
+  xSemaphoreGive(offlineLock);
+
+  if (kick) scheduleReplay(replayIntervalMs);
+  return ok;
+}
+
+// Makes the caller the only replayer; false when one is running or due.
+bool StateMQEsp::claimReplay() {
+  if (!offlineLock) return false;
+
+  xSemaphoreTake(offlineLock, portMAX_DELAY);
+  const bool claimed = !replayScheduled && offlineCount > 0;
+  if (claimed) replayScheduled = true;
+  xSemaphoreGive(offlineLock);
+  return claimed;
+}
+
+// Replayer only. Keeps the claim across the delay, or gives it up when
+// no timer slot is free (the next publish or connect claims it again).
+void StateMQEsp::scheduleReplay(uint32_t delay_ms) {
+  if (scheduleJob(JOB_OFFLINE_REPLAY, delay_ms, &StateMQEsp::offline_replay) != INVALID_ONESHOT) {
+    return;
+  }
+
+  xSemaphoreTake(offlineLock, portMAX_DELAY);
+  replayScheduled = false;
+  xSemaphoreGive(offlineLock);
+}
+
+void StateMQEsp::offline_replay(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (self) self->replayOffline();
+}
+
+// Replayer only (see claimReplay): the MQTT task on connect, then the
+// timer task between paced messages. The head is copied out and handed
+// to the outbox with no lock held, and only removed once it was accepted;
+// a refused send stays at the head and is retried.
+void StateMQEsp::replayOffline() {
+  for (;;) {
+    OfflineMsg m;
+
+    xSemaphoreTake(offlineLock, portMAX_DELAY);
+    const bool have = client && mqttConnected && offlineCount > 0;
+    if (have) {
+      m = offlineMsgs[0];
+      std::memcpy(replayBuf, offlinePool + m.offset, m.size);
+      replayHeadBusy = true;
+    } else {
+      replayScheduled = false;
+    }
+    xSemaphoreGive(offlineLock);
+
+    if (!have) return;
+
+    const char* topic = replayBuf;
+    const char* payload = replayBuf + m.topicLen + 1;
+    const bool sent = sendMessage(topic, payload, m.qos, m.retain, true) >= 0;
+
+    xSemaphoreTake(offlineLock, portMAX_DELAY);
+    replayHeadBusy = false;
+    if (sent && offlineCount > 0) {
+      offlineRemove(0);
+      offlineCounters.replayed++;
+    }
+    const bool more = offlineCount > 0;
+    if (!more) replayScheduled = false;
+    xSemaphoreGive(offlineLock);
+
+    if (!more) return;
+
+    if (!sent) {
+      scheduleReplay(replayIntervalMs ? replayIntervalMs : REPLAY_RETRY_MS);
+      return;
+    }
+    if (replayIntervalMs) {
+      scheduleReplay(replayIntervalMs);
+      return;
+    }
+  }
+}
+
+// Async publish
 
-int StateMQEsp::rawIndex(const char* topic) const {
-  if (!topic) return -1;
-  for (size_t i = 0; i < rawCount; ++i) {
-    if (raw[i].topic[0] && std::strcmp(raw[i].topic, topic) == 0) return (int)i;
-  }
-  return -1;
-}
+StateMQEsp::PublishTicket StateMQEsp::publishAsync(const char* topic,
+                                                   const char* payload,
+                                                   int qos,
+                                                   bool retain,
+                                                   PublishDone done,
+                                                   void* user) {
+  if (!topic || !topic[0]) return -1;
+  if (!client || !mqttConnected) return -1;
 
-bool StateMQEsp::subscribe(const char* topic, int qos) {
-  if (!topic || !*topic) return false;
+  int q = (qos < 0) ? defaultPubQos : qos;
+  q = clamp_qos(q);
 
-  qos = clamp_qos(qos);
+  const char* msg = payload ? payload : "";
 
-  int idx = rawIndex(topic);
-  if (idx < 0) {
-    if (rawCount >= MAX_RAW_SUBS) return false;
+  if (q == 0) return sendPublish(topic, msg, 0, 0, retain, true);
 
-    RawSlot& s = raw[rawCount];
-    std::strncpy(s.topic, topic, RAW_TOPIC_LEN);
-    s.topic[RAW_TOPIC_LEN - 1] = '\0';
-    s.payload[0] = '\0';
-    s.hasNew = false;
-    rawCount++;
+  InFlight* slot = nullptr;
+  portENTER_CRITICAL(&inflightMux);
+  for (InFlight& f : inflight) {
+    if (f.used) continue;
+    f = InFlight{true, 0, done, user};
+    inflightCount++;
+    slot = &f;
+    break;
   }
-
-  bool updated = false;
-  for (size_t i = 0; i < qosCount; ++i) {
-    if (qosTopic[i] && std::strcmp(qosTopic[i], topic) == 0) {
-      qosValue[i] = (int8_t)qos;
-      updated = true;
+  portEXIT_CRITICAL(&inflightMux);
+
+  if (!slot) return -1;
+
+  const int msg_id = sendPublish(topic, msg, 0, q, retain, true);
+
+  bool finished = false;
+  bool ok = false;
+
+  portENTER_CRITICAL(&inflightMux);
+  if (msg_id <= 0) {
+    slot->used = false;
+    inflightCount--;
+  } else {
+    slot->msgId = msg_id;
+    for (EarlyDone& e : early) {
+      if (e.msgId != msg_id) continue;
+      ok = e.ok;
+      e.msgId = 0;
+      slot->used = false;
+      inflightCount--;
+      finished = true;
       break;
     }
   }
-  if (!updated && qosCount < MAX_QOS_OVERRIDES) {
-    char* copy = dupstr(topic);
-    if (copy) {
-      qosTopic[qosCount] = copy;
-      qosValue[qosCount] = (int8_t)qos;
-      qosCount++;
-    }
-  }
+  portEXIT_CRITICAL(&inflightMux);
 
-  // If already connected, subscribe immediately.
-  if (mqttConnected && client) {
-    esp_mqtt_client_subscribe(client, topic, qos);
-  }
+  if (finished && done) done(msg_id, ok, user);
+  return (msg_id > 0) ? msg_id : -1;
+}
 
-  return true;
+size_t StateMQEsp::publishesInFlight() const {
+  return inflightCount;
 }
 
-const char* StateMQEsp::msg(const char* topic) {
-  if (!topic || !*topic) return nullptr;
+// Persistent outbox
 
-  int idx = rawIndex(topic);
-  if (idx < 0) return nullptr;
+bool StateMQEsp::setPersistentOutbox(const char* label, uint32_t segmentBytes) {
+  return durable.openPartition(label, segmentBytes);
+}
+
+bool StateMQEsp::setPersistentOutboxFile(const char* path, uint32_t sizeBytes, uint32_t segmentBytes) {
+  return durable.openFile(path, sizeBytes, segmentBytes);
+}
+
+bool StateMQEsp::publishDurable(const char* topic, const char* payload, int qos, bool retain) {
+  if (!topic || !topic[0]) return false;
+
+  int q = (qos < 0) ? defaultPubQos : qos;
+  q = clamp_qos(q);
 
-  RawSlot& s = raw[(size_t)idx];
-  if (!s.hasNew) return nullptr;
+  if (!durable.append(topic, payload ? payload : "", (uint8_t)q, retain)) return false;
 
-  s.hasNew = false;
-  return s.payload;
+  pumpDurable();
+  return true;
 }
 
-// Lifecycle
+PersistentOutbox::Stats StateMQEsp::outboxStats() const {
+  return durable.stats();
+}
 
-void StateMQEsp::cleanup(bool disconnect_wifi, bool clear_config) {
-  stopMqtt();
+// Coalescing publish
 
-  wifiHasIp = false;
-  mqttConnected = false;
-  core.setConnected(false);
+void StateMQEsp::setCoalesceInterval(uint32_t flush_ms) {
+  coalesceMs = flush_ms ? flush_ms : 1;
+}
 
-  // stop user tasks
-  if (taskHandles) {
-    for (size_t i = 0; i < taskHandlesCount; ++i) {
-      if (taskHandles[i]) {
-        vTaskDelete((TaskHandle_t)taskHandles[i]);
-        taskHandles[i] = nullptr;
-      }
-    }
-    delete[] taskHandles;
-    taskHandles = nullptr;
-  }
+StateMQEsp::CoalesceStats StateMQEsp::coalesceStats() const {
+  return coalesceCounters;
+}
 
-  // free task contexts
-  if (taskCtxs) {
-    for (size_t i = 0; i < taskHandlesCount; ++i) {
-      delete taskCtxs[i];
-      taskCtxs[i] = nullptr;
-    }
-    delete[] taskCtxs;
-    taskCtxs = nullptr;
-  }
+// Slots are keyed by their own copy of the topic, so publishLatest()
+// never touches the topic table and cannot fill it from a producer loop.
+bool StateMQEsp::publishLatest(const char* topic, const char* payload, int qos, bool retain) {
+  if (!topic || !topic[0]) return false;
 
-  taskHandlesCount = 0;
+  const size_t tlen = std::strlen(topic);
+  if (tlen > RAW_TOPIC_LEN - 1) return false;
+  const uint32_t hash = hashBytes(topic, tlen);
 
+  int q = (qos < 0) ? defaultPubQos : qos;
+  q = clamp_qos(q);
 
-  freestr(wifiSsid);
-  freestr(wifiPass);
-  freestr(brokerUri);
+  if (!payload) payload = "";
+  size_t len = std::strlen(payload);
+  if (len > RAW_PAYLOAD_LEN - 1) len = RAW_PAYLOAD_LEN - 1;
 
-  if (clear_config) {
-    freestr(stateTopic);
-    freeQosOverrides();
-    clearLastWill();
-    rawCount = 0;
-    for (size_t i = 0; i < MAX_RAW_SUBS; ++i) {
-      raw[i].topic[0] = '\0';
-      raw[i].payload[0] = '\0';
-      raw[i].hasNew = false;
-    }
-    StatePublishTopic("", -1, false);
-  }
+  bool ok = true;
 
+  portENTER_CRITICAL(&coalesceMux);
+  coalesceCounters.submitted++;
 
-  if (disconnect_wifi) {
-    esp_wifi_disconnect();
-    esp_wifi_stop();
+  size_t i = 0;
+  while (i < coalesceCount &&
+         (coalesceSlots[i].hash != hash || std::strcmp(coalesceSlots[i].topic, topic) != 0)) {
+    ++i;
   }
-}
 
-void StateMQEsp::end(bool disconnect_wifi) {
-  cleanup(disconnect_wifi, true);
-}
+  if (i == coalesceCount) {
+    if (coalesceCount < COALESCE_SLOTS) {
+      std::memcpy(coalesceSlots[i].topic, topic, tlen + 1);
+      coalesceSlots[i].hash = hash;
+      coalesceCount++;
+    } else {
+      coalesceCounters.dropped++;
+      ok = false;
+    }
+  }
 
-//public current and previous state upon transition
-void StateMQEsp::StatePublishTopic(const char* topic, int qos, bool enable, bool retain) {
-  freestr(stateTopic);
-  stateTopic = dupstr(topic ? topic : "");
-  statePubQos = qos;
-  statePubEnabled = enable && (stateTopic && stateTopic[0]);
-  statePubRetain = retain;
+  if (ok) {
+    CoalesceSlot& c = coalesceSlots[i];
+    if (c.pending) coalesceCounters.coalesced++;
+    std::memcpy(c.payload, payload, len);
+    c.payload[len] = '\0';
+    c.len = (uint16_t)len;
+    c.qos = (uint8_t)q;
+    c.retain = retain;
+    c.pending = true;
+  }
+  portEXIT_CRITICAL(&coalesceMux);
 
-  hasLastStatePub = false;
-  lastStatePub = StateMQ::OFFLINE_ID;
+  if (ok) armCoalesceFlush();
+  return ok;
 }
 
+void StateMQEsp::armCoalesceFlush() {
+  if (!client || !mqttConnected) return;
 
+  portENTER_CRITICAL(&coalesceMux);
+  const bool armed = coalesceArmed;
+  coalesceArmed = true;
+  portEXIT_CRITICAL(&coalesceMux);
+  if (armed) return;
 
-bool StateMQEsp::begin(const char* wifi_ssid,
-                       const char* wifi_pass,
-                       const char* broker_uri)
-{
-  cleanup(false, false);
-
-  if (!wifi_ssid || !broker_uri) return false;
+  if (scheduleJob(JOB_COALESCE_FLUSH, coalesceMs, &StateMQEsp::coalesce_flush) != INVALID_ONESHOT) return;
 
-  wifiSsid   = dupstr(wifi_ssid);
-  wifiPass   = dupstr(wifi_pass ? wifi_pass : "");
-  brokerUri  = dupstr(broker_uri);
+  // no timer slot; let the next publishLatest() or connect try again
+  portENTER_CRITICAL(&coalesceMux);
+  coalesceArmed = false;
+  portEXIT_CRITICAL(&coalesceMux);
+}
 
-  if (!wifiSsid || !wifiPass || !brokerUri) {
-    end(false);
-    return false;
-  }
+void StateMQEsp::coalesce_flush(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (self) self->flushCoalesced();
+}
 
-  core.setConnected(false);
+// Timer task. Sends every pending value once; while offline they stay
+// pending and the flush is re-armed on connect.
+void StateMQEsp::flushCoalesced() {
+  portENTER_CRITICAL(&coalesceMux);
+  coalesceArmed = false;
+  portEXIT_CRITICAL(&coalesceMux);
+
+  for (size_t i = 0; i < coalesceCount; ++i) {
+    if (!client || !mqttConnected) return;
+
+    portENTER_CRITICAL(&coalesceMux);
+    const bool pending = coalesceSlots[i].pending;
+    if (pending) {
+      coalesceOut = coalesceSlots[i];
+      coalesceSlots[i].pending = false;
+    }
+    portEXIT_CRITICAL(&coalesceMux);
 
-  // ---- init WiFi  ----
-  ESP_ERROR_CHECK(nvs_flash_init());
-  ESP_ERROR_CHECK(esp_netif_init());
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
-  esp_netif_create_default_wifi_sta();
+    if (!pending) continue;
 
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    const int id = sendPublish(coalesceOut.topic, coalesceOut.payload, coalesceOut.len,
+                               coalesceOut.qos, coalesceOut.retain, true);
+    portENTER_CRITICAL(&coalesceMux);
+    if (id >= 0) coalesceCounters.sent++;
+    else coalesceCounters.dropped++;
+    portEXIT_CRITICAL(&coalesceMux);
+  }
+}
 
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(
-      WIFI_EVENT, ESP_EVENT_ANY_ID, &StateMQEsp::wifi_event_handler, this, nullptr));
+// Streams log records into the client's outbox while the window has room.
+// Runs on the caller of publishDurable() or on the MQTT task. One caller
+// pumps at a time (durablePumping); the others only leave a kick behind,
+// which the pump picks up before it stops. durableMux is never held while
+// sending, so the MQTT task (which holds the client's API lock during
+// dispatch) can always take it.
+void StateMQEsp::pumpDurable() {
+  if (!durable.isOpen()) return;
+
+  portENTER_CRITICAL(&durableMux);
+  durableKick = true;
+  const bool owner = !durablePumping;
+  durablePumping = true;
+  portEXIT_CRITICAL(&durableMux);
+  if (!owner) return;
 
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(
-      IP_EVENT, IP_EVENT_STA_GOT_IP, &StateMQEsp::wifi_event_handler, this, nullptr));
+  for (;;) {
+    portENTER_CRITICAL(&durableMux);
+    const bool rewind = durableRewind;
+    durableRewind = false;
+    durableKick = false;
+    if (rewind) {
+      durableCount = 0;
+      for (EarlyDone& e : durableEarly) e.msgId = 0;
+    }
+    portEXIT_CRITICAL(&durableMux);
 
-  wifi_config_t wc{};
-  std::memset(&wc, 0, sizeof(wc));
-  std::strncpy((char*)wc.sta.ssid, wifiSsid, sizeof(wc.sta.ssid));
-  std::strncpy((char*)wc.sta.password, wifiPass, sizeof(wc.sta.password));
-  wc.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+    if (rewind) durable.rewind();
 
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wc));
-  ESP_ERROR_CHECK(esp_wifi_start());
+    while (sendDurable()) {}
 
-  ESP_LOGI(TAG_WIFI, "WiFi start -> connecting...");
-  ESP_ERROR_CHECK(esp_wifi_connect());
+    portENTER_CRITICAL(&durableMux);
+    const bool again = durableKick;
+    if (!again) durablePumping = false;
+    portEXIT_CRITICAL(&durableMux);
+    if (!again) return;
+  }
+}
 
-  core.onStateChange(&StateMQEsp::on_state_change_trampoline, this);
+void StateMQEsp::durable_pump(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (!self) return;
 
-  // ---- start tasks ----
-  taskHandlesCount = core.taskCount();
-  taskHandles = new (std::nothrow) void*[taskHandlesCount]();
-  taskCtxs    = new (std::nothrow) UserTaskCtx*[taskHandlesCount](); // NEW
+  portENTER_CRITICAL(&self->durableMux);
+  self->durableDeferred = false;
+  portEXIT_CRITICAL(&self->durableMux);
+  self->pumpDurable();
+}
 
-  for (size_t i = 0; i < core.taskCount(); ++i) {
-    const TaskDef& t = core.task(i);
+// Pump owner only. Copies the next record out, enqueues it with no lock
+// held, then records its msg_id. False when the window is full, the log
+// is drained or the enqueue failed.
+bool StateMQEsp::sendDurable() {
+  if (!client || !mqttConnected) return false;
 
-    auto* ctx = new (std::nothrow) UserTaskCtx{t.callback, t.callbackEx, t.user, t.period_ms};
-    if (!ctx) continue;
-
-    TaskHandle_t handle = nullptr;
-    const uint32_t stackBytes = stackBytesFor(t.stack);
-
-    if (xTaskCreate(
-          user_task_trampoline,
-          t.name ? t.name : "statemq_task",
-          stackBytes / sizeof(StackType_t),
-          ctx,
-          1,
-          &handle) != pdPASS) {
-      delete ctx;
-      if (taskCtxs && i < taskHandlesCount) taskCtxs[i] = nullptr;
-      continue;
+  portENTER_CRITICAL(&durableMux);
+  const bool room = durableCount < DURABLE_WINDOW;
+  portEXIT_CRITICAL(&durableMux);
+  if (!room) return false;
+
+  // the MQTT task leaves the record to the timer task while another task
+  // is inside an aliased send
+  if (aliasBusy()) {
+    portENTER_CRITICAL(&durableMux);
+    const bool arm = !durableDeferred;
+    durableDeferred = true;
+    portEXIT_CRITICAL(&durableMux);
+
+    if (arm && scheduleJob(JOB_DURABLE_PUMP, 0, &StateMQEsp::durable_pump) == INVALID_ONESHOT) {
+      portENTER_CRITICAL(&durableMux);
+      durableDeferred = false;
+      portEXIT_CRITICAL(&durableMux);
     }
+    return false;
+  }
 
-    if (taskHandles && i < taskHandlesCount) taskHandles[i] = handle;
-    if (taskCtxs    && i < taskHandlesCount) taskCtxs[i] = ctx;
-
-    if (!t.enabled && handle) {
-      vTaskSuspend(handle);
+  PersistentOutbox::Record r;
+  if (!durable.next(r)) return false;
+
+  const size_t tlen = std::strlen(r.topic);
+  const size_t plen = std::strlen(r.payload);
+  std::memcpy(durableBuf, r.topic, tlen + 1);
+  std::memcpy(durableBuf + tlen + 1, r.payload, plen + 1);
+  const PersistentOutbox::Ref ref = r.ref;
+
+  portENTER_CRITICAL(&durableMux);
+  durableSending = true;
+  portEXIT_CRITICAL(&durableMux);
+
+  // on failure the record stays live and is resent after the next rewind
+  const int id = sendPublish(durableBuf, durableBuf + tlen + 1, 0, r.qos, r.retain, true);
+
+  bool acked = false;
+  bool ackOk = false;
+
+  portENTER_CRITICAL(&durableMux);
+  durableSending = false;
+  if (id > 0) {
+    // the ack may have beaten us here; see durableTake()
+    for (EarlyDone& e : durableEarly) {
+      if (e.msgId != id) continue;
+      acked = true;
+      ackOk = e.ok;
+      e.msgId = 0;
+      break;
     }
+    if (!acked) durableInflight[durableCount++] = DurableInFlight{id, ref};
   }
+  portEXIT_CRITICAL(&durableMux);
 
+  if (id < 0) return false;
+  if (id == 0 || (acked && ackOk)) durable.release(ref); // QoS 0 is done once enqueued
   return true;
 }
 
+// MQTT task. True if msgId belonged to the persistent outbox. Only takes
+// durableMux; the flash write of release() happens outside it.
+bool StateMQEsp::durableTake(int msgId, bool ok) {
+  if (!durable.isOpen()) return false;
 
-// Runtime
+  bool found = false;
+  PersistentOutbox::Ref ref{};
 
-bool StateMQEsp::connected() const {
-  return mqttConnected;
+  portENTER_CRITICAL(&durableMux);
+  for (size_t i = 0; i < durableCount; ++i) {
+    if (durableInflight[i].msgId != msgId) continue;
+
+    ref = durableInflight[i].ref;
+    durableInflight[i] = durableInflight[--durableCount];
+    found = true;
+    break;
+  }
+  if (!found && durableSending) {
+    // the pump may not have stored this id yet
+    durableEarly[durableEarlyNext] = EarlyDone{msgId, ok};
+    durableEarlyNext = (durableEarlyNext + 1) % EARLY_SLOTS;
+  }
+  portEXIT_CRITICAL(&durableMux);
+
+  if (!found) return false;
+
+  // DELETED leaves the record live for the next connect
+  if (ok) durable.release(ref);
+  pumpDurable();
+  return true;
 }
 
-bool StateMQEsp::publish(const char* topic,
-                         const char* payload,
-                         int qos,
-                         bool retain) {
-  if (!topic || !topic[0]) return false;
-  if (!client || !mqttConnected) return false;
+// MQTT task.
+void StateMQEsp::onPublishDone(int msgId, bool ok) {
+  if (msgId <= 0) return;
+  if (durableTake(msgId, ok)) return;
+
+  PublishDone done = nullptr;
+  void* user = nullptr;
+  bool found = false;
+  bool reserved = false;
+
+  portENTER_CRITICAL(&inflightMux);
+  for (InFlight& f : inflight) {
+    if (f.used && f.msgId == 0) reserved = true;
+    if (!f.used || f.msgId != msgId) continue;
+    done = f.done;
+    user = f.user;
+    f.used = false;
+    inflightCount--;
+    found = true;
+    break;
+  }
+  if (!found && reserved) {
+    // a publishAsync() in progress may not have stored its id yet
+    early[earlyNext] = EarlyDone{msgId, ok};
+    earlyNext = (earlyNext + 1) % EARLY_SLOTS;
+  }
+  portEXIT_CRITICAL(&inflightMux);
 
-  int q = (qos < 0) ? defaultPubQos : qos;
-  q = clamp_qos(q);
+  if (done) done(msgId, ok, user);
+}
 
-  const char* msg = payload ? payload : "";
-  int msg_id = esp_mqtt_client_publish(client, topic, msg, 0, q, retain);
-  return msg_id >= 0;
+// Client stopped: outbox contents are gone.
+void StateMQEsp::failInFlight() {
+  for (InFlight& f : inflight) {
+    portENTER_CRITICAL(&inflightMux);
+    const bool used = f.used;
+    const InFlight copy = f;
+    f.used = false;
+    if (used) inflightCount--;
+    portEXIT_CRITICAL(&inflightMux);
+
+    if (used && copy.done) copy.done(copy.msgId, false, copy.user);
+  }
+
+  portENTER_CRITICAL(&inflightMux);
+  for (EarlyDone& e : early) e = EarlyDone{};
+  portEXIT_CRITICAL(&inflightMux);
 }
 
 bool StateMQEsp::taskEnable(StateMQ::TaskId id, bool enable) {
   if (id >= core.taskCount()) return false;
-  if (!taskHandles || id >= taskHandlesCount) return false;
+  if (id >= taskHandlesCount) return false;
 
   core.taskEnable(id, enable);
 
@@ -424,26 +2573,64 @@ bool StateMQEsp::taskEnable(StateMQ::TaskId id, bool enable) {
 void StateMQEsp::subscribeAllUnique() {
   if (!client) return;
 
-  const char* seen[64];
-  size_t seen_n = 0;
+  syncRuleTopics();
+  abortSync();
+
+  // open the window before subscribing; SUBACKs arrive on this task
+  // only after we return
+  bool sync = false;
+  if (syncTimeoutMs > 0) {
+    portENTER_CRITICAL(&syncMux);
+    syncActive = true;
+    syncCount = 0;
+    syncPending = 0;
+    portEXIT_CRITICAL(&syncMux);
+    sync = true;
+  }
+
+  int      ids[MAX_SYNC_SUBS];
+  uint16_t pending = 0;
 
-  for (size_t i = 0; i < core.ruleCount(); ++i) {
-    const char* t = core.rule(i).topic;
-    if (!t || !*t) continue;
-    if (topic_seen(t, seen, seen_n)) continue;
+  // every interned topic is unique; skip entries nothing listens on
+  for (size_t i = 0; i < topicCount; ++i) {
+    const TopicEntry& t = topics[i];
+    if (!t.ruleMask && !t.raw && !t.stream) continue;
 
-    if (seen_n < 64) seen[seen_n++] = t;
-    esp_mqtt_client_subscribe(client, t, qosForTopic(t));
+    const int msgId = esp_mqtt_client_subscribe(client, t.name, (t.qos < 0) ? defaultSubQos : t.qos);
+    if (msgId >= 0) ids[pending++] = msgId;
   }
 
-  for (size_t i = 0; i < rawCount; ++i) {
-    const char* t = raw[i].topic;
-    if (!t || !*t) continue;
-    if (topic_seen(t, seen, seen_n)) continue;
+  // rules left out of the table, once per topic
+  for (size_t i = 0; i < rulesInterned; ++i) {
+    if (!(unmappedRules & (1UL << i))) continue;
+
+    const char* topic = core.rule(i).topic;
+    if (unmappedRuleMask(topic) & ((1UL << i) - 1)) continue;
+    const int msgId = esp_mqtt_client_subscribe(client, topic, defaultSubQos);
+    if (msgId >= 0) ids[pending++] = msgId;
+  }
+
+  if (!sync) return;
+
+  if (pending == 0) {
+    finishSync();
+    return;
+  }
 
-    if (seen_n < 64) seen[seen_n++] = t;
-    esp_mqtt_client_subscribe(client, t, qosForTopic(t));
+  const OneShotId timer = scheduleJob(JOB_SYNC_TIMEOUT, syncTimeoutMs, &StateMQEsp::sync_timeout);
+  if (timer == INVALID_ONESHOT) {
+    // without a timeout a lost SUBACK would hold retained state forever;
+    // close the window and apply retained messages as they arrive
+    ESP_LOGW(TAG_MQTT, "retained sync: no timer slot, sync disabled for this connect");
+    finishSync();
+    return;
   }
+
+  portENTER_CRITICAL(&syncMux);
+  std::memcpy(syncMsgIds, ids, pending * sizeof(ids[0]));
+  syncPending = pending;
+  syncTimer = timer;
+  portEXIT_CRITICAL(&syncMux);
 }
 
 // WiFi events 
@@ -496,6 +2683,8 @@ void StateMQEsp::mqtt_event_handler(void* arg,
   auto* e = (esp_mqtt_event_handle_t)data;
   if (!e) return;
 
+  self->mqttTask = xTaskGetCurrentTaskHandle();
+
   switch (e->event_id) {
     case MQTT_EVENT_CONNECTED:
       self->onMqttConnected();
@@ -503,6 +2692,15 @@ void StateMQEsp::mqtt_event_handler(void* arg,
     case MQTT_EVENT_DISCONNECTED:
       self->onMqttDisconnected();
       break;
+    case MQTT_EVENT_SUBSCRIBED:
+      self->onMqttSubscribed(e);
+      break;
+    case MQTT_EVENT_PUBLISHED:
+      self->onPublishDone(e->msg_id, true);
+      break;
+    case MQTT_EVENT_DELETED:
+      self->onPublishDone(e->msg_id, false);
+      break;
     case MQTT_EVENT_DATA:
       self->onMqttData(e);
       break;
@@ -512,45 +2710,184 @@ void StateMQEsp::mqtt_event_handler(void* arg,
 }
 
 void StateMQEsp::onMqttConnected() {
+  // aliases are per connection; entries from older sessions are stale
+  aliasSession++;
+  aliasCap = aliasMax;
   mqttConnected = true;
+  // the schema goes out from the publish job, ahead of the CONNECTED
+  // record that setConnected() queues
+  portENTER_CRITICAL(&statePubMux);
+  statePubSchema = true;
+  portEXIT_CRITICAL(&statePubMux);
   core.setConnected(true);
   ESP_LOGI(TAG_MQTT, "MQTT connected");
   subscribeAllUnique();
+  if (claimReplay()) replayOffline();
+  armCoalesceFlush();
+
+  // start over from the oldest unreleased record; anything in flight on
+  // the previous session is sent again. The pump owner applies the rewind.
+  if (durable.isOpen()) {
+    portENTER_CRITICAL(&durableMux);
+    durableRewind = true;
+    portEXIT_CRITICAL(&durableMux);
+    pumpDurable();
+  }
 }
 
 void StateMQEsp::onMqttDisconnected() {
   mqttConnected = false;
+  abortSync();
   core.setConnected(false);
   ESP_LOGW(TAG_MQTT, "MQTT disconnected");
 }
 
+// esp-mqtt delivers payloads larger than its buffer as several DATA events:
+// the first carries the topic and current_data_offset == 0, the rest only
+// data. Stream sinks get every chunk; rules and raw slots see the message
+// once, when it is complete.
 void StateMQEsp::onMqttData(esp_mqtt_event_handle_t e) {
-  const size_t tlen = (e->topic_len > 0) ? (size_t)e->topic_len : 0;
-  const size_t dlen = (e->data_len  > 0) ? (size_t)e->data_len  : 0;
+  const size_t tlen   = (e->topic_len > 0) ? (size_t)e->topic_len : 0;
+  const size_t dlen   = (e->data_len  > 0) ? (size_t)e->data_len  : 0;
+  const size_t offset = (e->current_data_offset > 0) ? (size_t)e->current_data_offset : 0;
+  const size_t total  = (e->total_data_len > 0) ? (size_t)e->total_data_len : dlen;
+
+  if (offset == 0) {
+    if (tlen == 0) return;
+
+    const size_t tcopy = (tlen < sizeof(rxTopic) - 1) ? tlen : (sizeof(rxTopic) - 1);
+    std::memcpy(rxTopic, e->topic, tcopy);
+    rxTopic[tcopy] = '\0';
+
+    rxLen = 0;
+    rxTotal = total;
+    rxTopicHash = topicHash(rxTopic);
+    rxTopicId = topicFind(rxTopic, rxTopicHash);
+    rxMsgId = (uint16_t)e->msg_id;
+    rxDup = e->dup;
+    rxRetain = e->retain;
+    rxStream = (rxTopicId >= 0) ? (int)topics[rxTopicId].stream - 1 : -1;
+    rxActive = true;
+#if STATEMQ_COMPRESSION
+    // by the marker, so wildcard and unmarked subscriptions expand too
+    rxCompressed = compress::isCompressed(e->data, dlen);
+    zRxLen = 0;
+#endif
+  } else if (!rxActive || offset != rxNext) {
+    // missed the start of this message
+    rxActive = false;
+    return;
+  }
 
-  if (tlen == 0) return;
+  rxNext = offset + dlen;
 
-  char topic[RAW_TOPIC_LEN];
-  char data[RAW_PAYLOAD_LEN];
+  if (rxStream >= 0) {
+    const StreamSlot& st = streams[(size_t)rxStream];
+    if (st.sink) st.sink(rxTopic, e->data, dlen, offset, rxTotal, st.user);
+  }
+
+  const size_t room = sizeof(rxData) - 1 - rxLen;
+  const size_t dcopy = (dlen < room) ? dlen : room;
+  std::memcpy(rxData + rxLen, e->data, dcopy);
+  rxLen += dcopy;
+
+#if STATEMQ_COMPRESSION
+  if (rxCompressed) {
+    const size_t zroom = sizeof(zRx) - zRxLen;
+    const size_t zcopy = (dlen < zroom) ? dlen : zroom;
+    std::memcpy(zRx + zRxLen, e->data, zcopy);
+    zRxLen += zcopy;
+  }
+#endif
+
+  if (rxNext < rxTotal) return;
+
+  rxActive = false;
+  rxData[rxLen] = '\0';
+
+  if (isDuplicate()) return;
+
+  const char* data = rxData;
+  size_t len = rxLen;
+  bool complete = rxTotal == rxLen;
+
+#if STATEMQ_COMPRESSION
+  if (rxCompressed && compress::isCompressed(zRx, zRxLen)) {
+    const size_t n = (zRxLen == rxTotal)
+                         ? compress::decompress(zRx, zRxLen, zPlain, sizeof(zPlain) - 1)
+                         : 0;
+    if (n) {
+      zPlain[n] = '\0';
+      data = zPlain;
+      len = n;
+      complete = true;
+      compressCounters.expanded++;
+    } else {
+      // too large or corrupt. On an enabled topic the wire bytes mean
+      // nothing to readers; elsewhere they may be a binary payload that
+      // merely starts like the marker, so they go through as sent.
+      compressCounters.rejected++;
+      if (rxTopicId >= 0 && topics[rxTopicId].compress) return;
+    }
+  }
+#endif
 
-  size_t tcopy = (tlen < sizeof(topic) - 1) ? tlen : (sizeof(topic) - 1);
-  size_t dcopy = (dlen < sizeof(data)  - 1) ? dlen : (sizeof(data)  - 1);
+  if (!rateLimited) {
+    deliverMessage(rxTopicId, rxTopic, data, len, complete, rxRetain);
+    return;
+  }
 
-  std::memcpy(topic, e->topic, tcopy);
-  topic[tcopy] = '\0';
+  xSemaphoreTake(ingestLock, portMAX_DELAY);
+  const bool admitted = admit(data, len, complete);
+  xSemaphoreGive(ingestLock);
+  if (!admitted) return;
 
-  std::memcpy(data, e->data, dcopy);
-  data[dcopy] = '\0';
+  // never block here: the timer task may be delivering into a callback
+  // that waits for the API lock this task holds
+  if (xSemaphoreTake(deliverLock, 0) == pdTRUE) {
+    deliverMessage(rxTopicId, rxTopic, data, len, complete, rxRetain);
+    xSemaphoreGive(deliverLock);
+    return;
+  }
 
-  core.applyMessage(topic, data);
+  xSemaphoreTake(ingestLock, portMAX_DELAY);
+  const int lim = (rxTopicId >= 0) ? topics[rxTopicId].limit : 0;
+  holdMessage((uint8_t)(limits[lim].rate ? lim : 0), true, data, len, complete);
+  xSemaphoreGive(ingestLock);
+}
 
-  int idx = rawIndex(topic);
-  if (idx >= 0) {
-    RawSlot& s = raw[(size_t)idx];
-    std::strncpy(s.payload, data, RAW_PAYLOAD_LEN);
-    s.payload[RAW_PAYLOAD_LEN - 1] = '\0';
-    s.hasNew = true;
+// Rules, raw slots and wildcard matches for one complete message. Runs on
+// the MQTT task, or on the timer task for held messages; with rate limits
+// the delivery lock keeps raw slots single-writer.
+void StateMQEsp::deliverMessage(int topicId, const char* topic, const char* data, size_t len,
+                                bool complete, bool retained) {
+  uint32_t ruleMask = (topicId >= 0) ? topics[topicId].ruleMask : 0;
+  if (unmappedRules) ruleMask |= unmappedRuleMask(topic);
+
+  // a truncated payload must not match a rule by its prefix
+  if (ruleMask && complete && !deferRetained(data, ruleMask, retained)) {
+    core.applyMessage(topic, data, ruleMask);
+  }
+  if (topicId >= 0 && topics[topicId].raw) {
+    storeRaw(topics[topicId].raw - 1, topic, data, len);
   }
+
+  if (trieCount > 1) trieMatch(0, topic, true, topic, data, len);
+}
+
+void StateMQEsp::storeRaw(size_t index, const char* topic, const char* data, size_t len) {
+  RawSlot& s = raw[index];
+  // writer side: publish buf[wr], take back whichever buffer was latest
+  const size_t n = (len < RAW_PAYLOAD_LEN - 1) ? len : (RAW_PAYLOAD_LEN - 1);
+  std::memcpy(s.buf[s.wr], data, n);
+  s.buf[s.wr][n] = '\0';
+  s.bufLen[s.wr] = (uint16_t)n;
+
+  const uint8_t prev = s.latest.exchange(s.wr | LATEST_FRESH, std::memory_order_acq_rel);
+  s.wr = prev & 3U;
+
+  if (s.ring) ringPush(s, data, len);
+  deliverRaw(index, topic, data, len);
 }
 
 // MQTT start/stop
@@ -563,6 +2900,9 @@ void StateMQEsp::startMqttIfNeeded() {
   esp_mqtt_client_config_t c{};
   c.broker.address.uri = brokerUri;
   c.session.keepalive = (keepAliveSec > 0) ? keepAliveSec : 30;
+#if defined(CONFIG_MQTT_PROTOCOL_5)
+  if (aliasMax) c.session.protocol_ver = MQTT_PROTOCOL_V_5;
+#endif
 
   if (lwtEnabled && willTopic && willTopic[0]) {
     c.session.last_will.topic  = willTopic;
@@ -597,37 +2937,242 @@ void StateMQEsp::stopMqtt() {
   esp_mqtt_client_stop(client);
   esp_mqtt_client_destroy(client);
   client = nullptr;
+
+  failInFlight();
 }
 
 
+// Queue the edge on every transition task whose filter matches; rule
+// strings are used for topic/payload because the caller's buffers do not
+// outlive this call.
+void StateMQEsp::dispatchTransition(const StateMQ::StateChangeCtx& ctx) {
+  for (size_t i = 0; i < taskHandlesCount; ++i) {
+    UserTaskCtx* t = taskCtxs[i];
+    TaskHandle_t h = (TaskHandle_t)taskHandles[i];
+    if (!t || !h || !t->cbEdge) continue;
+    if (!core.taskWantsTransition(i, ctx.prev, ctx.curr)) continue;
+
+    StateMQ::StateChangeCtx sc = ctx;
+    sc.user = t->user;
+    sc.topic = nullptr;
+    sc.payload = nullptr;
+    if (ctx.ruleIndex >= 0 && (size_t)ctx.ruleIndex < core.ruleCount()) {
+      const Rule& r = core.rule((size_t)ctx.ruleIndex);
+      sc.topic = r.topic;
+      sc.payload = r.message;
+    }
+
+    portENTER_CRITICAL(&t->lock);
+    if (t->edgeCount == EDGE_QUEUE) {
+      t->edgeHead = (uint8_t)((t->edgeHead + 1) % EDGE_QUEUE);
+      t->edgeCount--;
+      t->edgesDropped++;
+    }
+    t->edges[(t->edgeHead + t->edgeCount) % EDGE_QUEUE] = sc;
+    t->edgeCount++;
+    portEXIT_CRITICAL(&t->lock);
+
+    xTaskNotifyGive(h);
+  }
+}
+
 void StateMQEsp::on_state_change_trampoline(const StateMQ::StateChangeCtx& ctx) {
   auto* self = static_cast<StateMQEsp*>(ctx.user);
   if (!self) return;
 
+  if (self->appStateCb) {
+    StateMQ::StateChangeCtx app = ctx;
+    app.user = self->appStateUser;
+    self->appStateCb(app);
+  }
+
+  self->dispatchTransition(ctx);
+
   if (!self->statePubEnabled) return;
-  if (!self->stateTopic || !self->stateTopic[0]) return;
   if (!self->client || !self->mqttConnected) return;
 
-  // Use last published as prev
-  StateMQ::StateId prevId = self->hasLastStatePub ? self->lastStatePub : ctx.prev;
-  StateMQ::StateId currId = ctx.curr;
-  self->lastStatePub = currId;
-  self->hasLastStatePub = true;
+  // Queue only. A full queue drops its oldest entry; the published prev
+  // is taken from the last state actually sent, so the chain stays intact.
+  bool arm = false;
+  portENTER_CRITICAL(&self->statePubMux);
+  if (self->statePubCount == STATE_PUB_QUEUE) {
+    self->statePubHead = (self->statePubHead + 1) % STATE_PUB_QUEUE;
+    self->statePubCount--;
+  }
+  const size_t tail = (self->statePubHead + self->statePubCount) % STATE_PUB_QUEUE;
+  const uint8_t rule = (ctx.ruleIndex >= 0 && ctx.ruleIndex < statecodec::NO_RULE)
+                       ? (uint8_t)ctx.ruleIndex : statecodec::NO_RULE;
+  self->statePubQueue[tail] = StatePub{ctx.prev, ctx.curr, (uint8_t)ctx.cause, rule, uptime_ms()};
+  self->statePubCount++;
+  if (!self->statePubArmed) {
+    self->statePubArmed = true;
+    arm = true;
+  }
+  portEXIT_CRITICAL(&self->statePubMux);
+
+  if (arm && self->scheduleJob(JOB_STATE_PUBLISH, 0, &StateMQEsp::state_publish) == INVALID_ONESHOT) {
+    portENTER_CRITICAL(&self->statePubMux);
+    self->statePubArmed = false;
+    portEXIT_CRITICAL(&self->statePubMux);
+  }
+}
+
+// Quoted state names, indexed by StateId. Every user state comes from a
+// rule, so the highest rule state bounds the ids in use.
+void StateMQEsp::buildStateFrags() {
+  size_t count = 2;
+  for (size_t i = 0; i < core.ruleCount(); ++i) {
+    const size_t id = (size_t)core.rule(i).stateId + 1;
+    if (id > count) count = id;
+  }
+  if (count > STATE_FRAGS) count = STATE_FRAGS;
+
+  for (size_t id = 0; id < count; ++id) {
+    const char* name = core.stateName((StateMQ::StateId)id);
+    if (!name) name = "";
+
+    size_t n = std::strlen(name);
+    if (n > STATE_FRAG_LEN - 2) n = STATE_FRAG_LEN - 2;
+
+    StateFrag& f = stateFrags[id];
+    f.text[0] = '"';
+    std::memcpy(f.text + 1, name, n);
+    f.text[n + 1] = '"';
+    f.len = (uint8_t)(n + 2);
+  }
+  stateFragCount = count;
+}
+
+static char* put(char* p, const char* s, size_t n) {
+  std::memcpy(p, s, n);
+  return p + n;
+}
+
+static char* put_u32(char* p, uint32_t v) {
+  char tmp[10];
+  size_t n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  while (n) *p++ = tmp[--n];
+  return p;
+}
+
+// {"prev":"A","curr":"B","uptime_ms":N}
+size_t StateMQEsp::formatStatePub(const StatePub& e, char* out, size_t cap) {
+  static constexpr char K_PREV[] = "{\"prev\":";
+  static constexpr char K_CURR[] = ",\"curr\":";
+  static constexpr char K_UP[]   = ",\"uptime_ms\":";
+
+  const StateFrag& fp = stateFrags[e.prev < stateFragCount ? e.prev : StateMQ::CONNECTED_ID];
+  const StateFrag& fc = stateFrags[e.curr < stateFragCount ? e.curr : StateMQ::CONNECTED_ID];
+
+  static_assert(sizeof(K_PREV) + sizeof(K_CURR) + sizeof(K_UP) + 2 * STATE_FRAG_LEN + 10 + 1
+                <= STATE_PAYLOAD_LEN, "state payload buffer");
+  if (cap < STATE_PAYLOAD_LEN) return 0;
+
+  char* p = out;
+  p = put(p, K_PREV, sizeof(K_PREV) - 1);
+  p = put(p, fp.text, fp.len);
+  p = put(p, K_CURR, sizeof(K_CURR) - 1);
+  p = put(p, fc.text, fc.len);
+  p = put(p, K_UP, sizeof(K_UP) - 1);
+  p = put_u32(p, e.uptime);
+  *p++ = '}';
+  *p = '\0';
+  return (size_t)(p - out);
+}
+
+void StateMQEsp::StatePublishFormat(StatePubFormat format, const char* schema_topic) {
+  statePubFormat = format;
+  freestr(schemaTopic);
+  schemaTopic = (schema_topic && schema_topic[0]) ? dupstr(schema_topic) : nullptr;
+}
+
+// Retained {"v":1,"states":[...]}; ids index the array.
+void StateMQEsp::publishStateSchema() {
+  if (statePubFormat != StatePubFormat::Binary || !statePubEnabled) return;
+  if (!client || !mqttConnected || !stateTopic || !stateTopic[0]) return;
+
+  const char* names[STATE_FRAGS];
+  for (size_t i = 0; i < stateFragCount; ++i) {
+    names[i] = core.stateName((StateMQ::StateId)i);
+  }
 
-  const char* prevName = self->core.stateName(prevId);
-  const char* currName = self->core.stateName(currId);
+  char json[STATE_FRAGS * STATE_FRAG_LEN + 24];
+  const size_t len = statecodec::writeSchema(names, stateFragCount, json, sizeof(json));
+  if (!len) return;
 
-  char payload[256];
-  std::snprintf(payload, sizeof(payload),
-                "{\"prev\":\"%s\",\"curr\":\"%s\",\"uptime_ms\":%u}",
-                prevName ? prevName : "",
-                currName ? currName : "",
-                (unsigned)uptime_ms());
+  char topic[RAW_TOPIC_LEN];
+  const char* t = schemaTopic;
+  if (!t) {
+    std::snprintf(topic, sizeof(topic), "%s/schema", stateTopic);
+    t = topic;
+  }
 
-  int q = (self->statePubQos < 0) ? self->defaultPubQos : self->statePubQos;
+  int q = (statePubQos < 0) ? defaultPubQos : statePubQos;
   q = clamp_qos(q);
 
-  esp_mqtt_client_publish(self->client, self->stateTopic, payload, 0, q, self->retainState);
+  sendPublish(t, json, (int)len, q, true, true);
+}
+
+void StateMQEsp::state_publish(void* arg) {
+  auto* self = static_cast<StateMQEsp*>(arg);
+  if (self) self->publishStates();
+}
+
+// Timer task.
+void StateMQEsp::publishStates() {
+  char payload[STATE_PAYLOAD_LEN];
+
+  for (;;) {
+    StatePub e{};
+    bool have = false;
+    bool schema = false;
+
+    portENTER_CRITICAL(&statePubMux);
+    if (statePubCount) {
+      e = statePubQueue[statePubHead];
+      statePubHead = (statePubHead + 1) % STATE_PUB_QUEUE;
+      statePubCount--;
+      have = true;
+      schema = statePubSchema;
+      statePubSchema = false;
+    } else {
+      statePubArmed = false;
+    }
+    portEXIT_CRITICAL(&statePubMux);
+
+    if (!have) return;
+    if (!statePubEnabled || !stateTopic || !stateTopic[0]) continue;
+    if (!client || !mqttConnected) continue;
+    if (schema) publishStateSchema();
+
+    // Use last published as prev
+    if (hasLastStatePub) e.prev = lastStatePub;
+    lastStatePub = e.curr;
+    hasLastStatePub = true;
+
+    // A rule added after begin() can name a state not yet prebuilt.
+    if (e.prev >= stateFragCount || e.curr >= stateFragCount) {
+      buildStateFrags();
+      if (statePubFormat == StatePubFormat::Binary) publishStateSchema();
+    }
+
+    size_t len = 0;
+    if (statePubFormat == StatePubFormat::Binary) {
+      const statecodec::StateRecord r{e.prev, e.curr, e.cause, e.rule, e.uptime};
+      len = statecodec::encode(r, reinterpret_cast<uint8_t*>(payload), sizeof(payload));
+    } else {
+      len = formatStatePub(e, payload, sizeof(payload));
+    }
+
+    int q = (statePubQos < 0) ? defaultPubQos : statePubQos;
+    q = clamp_qos(q);
+
+    sendPublish(stateTopic, payload, (int)len, q, retainState, true);
+  }
 }
 
 
@@ -0,0 +1,405 @@
+#include "StateMQ_Outbox.h"
+
+#include <cstddef>
+#include <cstring>
+
+extern "C" {
+#include "esp_log.h"
+}
+
+namespace statemq {
+
+static const char* TAG_OUTBOX = "statemq_outbox";
+
+static uint32_t align4(uint32_t n) {
+  return (n + 3U) & ~3U;
+}
+
+namespace {
+struct OutboxGuard {
+  SemaphoreHandle_t m;
+  explicit OutboxGuard(SemaphoreHandle_t h) : m(h) { xSemaphoreTake(m, portMAX_DELAY); }
+  ~OutboxGuard() { xSemaphoreGive(m); }
+};
+} // namespace
+
+PersistentOutbox::PersistentOutbox() {
+  lock = xSemaphoreCreateMutexStatic(&lockBuf);
+}
+
+PersistentOutbox::~PersistentOutbox() {
+  close();
+}
+
+// Open / close
+
+bool PersistentOutbox::openPartition(const char* label, uint32_t segmentBytes) {
+  close();
+
+  const esp_partition_t* p =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (!p) {
+    ESP_LOGE(TAG_OUTBOX, "partition '%s' not found", label ? label : "");
+    return false;
+  }
+  if (segmentBytes == 0 || segmentBytes > 65536 || segmentBytes % p->erase_size != 0) return false;
+
+  OutboxGuard g(lock);
+  part = p;
+  segBytes = segmentBytes;
+  segCount = p->size / segmentBytes;
+  if (segCount > MAX_SEGMENTS) segCount = MAX_SEGMENTS;
+
+  if (segCount < 2 || !mount()) {
+    part = nullptr;
+    segCount = 0;
+    return false;
+  }
+  return true;
+}
+
+// Host/linux targets: a file of `sizeBytes`, extended with 0xFF (erased)
+// on first use.
+bool PersistentOutbox::openFile(const char* path, uint32_t sizeBytes, uint32_t segmentBytes) {
+  close();
+  if (!path || segmentBytes < 256 || segmentBytes > 65536) return false;
+
+  FILE* f = fopen(path, "r+b");
+  if (!f) f = fopen(path, "w+b");
+  if (!f) {
+    ESP_LOGE(TAG_OUTBOX, "cannot open %s", path);
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long have = ftell(f);
+  uint8_t ff[64];
+  std::memset(ff, 0xFF, sizeof(ff));
+  while (have >= 0 && (uint32_t)have < sizeBytes) {
+    const size_t n = ((sizeBytes - (uint32_t)have) < sizeof(ff)) ? (sizeBytes - (uint32_t)have) : sizeof(ff);
+    if (fwrite(ff, 1, n, f) != n) break;
+    have += (long)n;
+  }
+  fflush(f);
+
+  OutboxGuard g(lock);
+  file = f;
+  segBytes = segmentBytes;
+  segCount = sizeBytes / segmentBytes;
+  if (segCount > MAX_SEGMENTS) segCount = MAX_SEGMENTS;
+
+  if (have < 0 || (uint32_t)have < sizeBytes || segCount < 2 || !mount()) {
+    fclose(file);
+    file = nullptr;
+    segCount = 0;
+    return false;
+  }
+  return true;
+}
+
+void PersistentOutbox::close() {
+  OutboxGuard g(lock);
+  if (file) fclose(file);
+  file = nullptr;
+  part = nullptr;
+  segCount = 0;
+}
+
+// Storage access
+
+bool PersistentOutbox::readAt(uint32_t addr, void* dst, size_t len) {
+  if (part) return esp_partition_read(part, addr, dst, len) == ESP_OK;
+  if (!file || fseek(file, (long)addr, SEEK_SET) != 0) return false;
+  return fread(dst, 1, len, file) == len;
+}
+
+bool PersistentOutbox::writeAt(uint32_t addr, const void* src, size_t len) {
+  if (part) return esp_partition_write(part, addr, src, len) == ESP_OK;
+  if (!file || fseek(file, (long)addr, SEEK_SET) != 0) return false;
+  if (fwrite(src, 1, len, file) != len) return false;
+  return fflush(file) == 0;
+}
+
+bool PersistentOutbox::eraseSeg(size_t seg) {
+  const uint32_t base = (uint32_t)seg * segBytes;
+  if (part) return esp_partition_erase_range(part, base, segBytes) == ESP_OK;
+
+  uint8_t ff[64];
+  std::memset(ff, 0xFF, sizeof(ff));
+  for (uint32_t off = 0; off < segBytes; off += sizeof(ff)) {
+    const size_t n = ((segBytes - off) < sizeof(ff)) ? (segBytes - off) : sizeof(ff);
+    if (!writeAt(base + off, ff, n)) return false;
+  }
+  return true;
+}
+
+bool PersistentOutbox::formatSeg(size_t seg, uint32_t eraseCount) {
+  segSeq[seg] = 0;
+  segLive[seg] = 0;
+  if (!eraseSeg(seg)) return false;
+  counters.erases++;
+
+  SegHeader h{SEG_MAGIC, nextSeq, eraseCount, 0};
+  h.crc = crc32(0, &h, offsetof(SegHeader, crc));
+  if (!writeAt((uint32_t)seg * segBytes, &h, sizeof(h))) return false;
+  counters.flashBytes += sizeof(h);
+
+  segSeq[seg] = nextSeq++;
+  return true;
+}
+
+// Mount: the segment with the highest seq is the write head; the ones
+// after it (round-robin) are older. Live records are counted so rotation
+// knows what it drops.
+bool PersistentOutbox::mount() {
+  counters = Stats{};
+  nextSeq = 1;
+  active = 0;
+  bool any = false;
+
+  for (size_t seg = 0; seg < segCount; ++seg) {
+    segSeq[seg] = 0;
+    segLive[seg] = 0;
+
+    SegHeader h;
+    if (!readAt((uint32_t)seg * segBytes, &h, sizeof(h))) continue;
+    if (h.magic != SEG_MAGIC || h.crc != crc32(0, &h, offsetof(SegHeader, crc))) continue;
+
+    segSeq[seg] = h.seq;
+    if (h.seq >= nextSeq) nextSeq = h.seq + 1;
+    if (!any || h.seq > segSeq[active]) active = seg;
+    any = true;
+  }
+
+  if (!any) {
+    if (!formatSeg(0, 1)) return false;
+    writeOff = sizeof(SegHeader);
+    curSeg = 1 % segCount;
+    curOff = sizeof(SegHeader);
+    return true;
+  }
+
+  for (size_t seg = 0; seg < segCount; ++seg) {
+    if (!segSeq[seg]) continue;
+
+    uint32_t off = sizeof(SegHeader);
+    for (;;) {
+      RecHeader h;
+      bool valid = true;
+      const uint32_t sz = readRecord(seg, off, h, valid);
+      if (!sz) {
+        if (!valid) {
+          // unreadable header: nothing after it can be trusted
+          counters.corrupt++;
+          off = segBytes;
+        }
+        break;
+      }
+
+      if (!valid) counters.corrupt++;
+      else if (h.state == REC_LIVE) {
+        segLive[seg]++;
+        counters.live++;
+      }
+      off += sz;
+    }
+
+    if (seg == active) writeOff = off;
+  }
+
+  ESP_LOGI(TAG_OUTBOX, "%u live records, %u corrupt",
+           (unsigned)counters.live, (unsigned)counters.corrupt);
+
+  curSeg = (active + 1) % segCount;
+  curOff = sizeof(SegHeader);
+  return true;
+}
+
+uint32_t PersistentOutbox::readRecord(size_t seg, uint32_t off, RecHeader& h, bool& valid) {
+  valid = true;
+  if (off + sizeof(RecHeader) > segBytes) return 0;
+
+  const uint32_t base = (uint32_t)seg * segBytes + off;
+  if (!readAt(base, &h, sizeof(h))) return 0;
+  if (h.magic == 0xFFFF) return 0; // erased: end of records
+
+  if (h.magic != REC_MAGIC || h.len < 2 || h.topicLen + 2U > h.len ||
+      sizeof(RecHeader) + h.len > MAX_RECORD || off + sizeof(RecHeader) + h.len > segBytes) {
+    valid = false;
+    return 0;
+  }
+
+  if (!readAt(base + sizeof(RecHeader), rbuf, h.len)) {
+    valid = false;
+  } else {
+    valid = (recordCrc(h, rbuf) == h.crc) && rbuf[h.topicLen] == '\0' && rbuf[h.len - 1] == '\0';
+  }
+  return align4(sizeof(RecHeader) + h.len);
+}
+
+// Append
+
+bool PersistentOutbox::rotate() {
+  const size_t next = (active + 1) % segCount;
+
+  uint32_t eraseCount = 1;
+  SegHeader old;
+  if (segSeq[next] && readAt((uint32_t)next * segBytes, &old, sizeof(old))) {
+    eraseCount = old.eraseCount + 1;
+  }
+
+  if (segLive[next]) {
+    ESP_LOGW(TAG_OUTBOX, "outbox full, dropping %u oldest records", (unsigned)segLive[next]);
+    counters.dropped += segLive[next];
+    counters.live -= segLive[next];
+  }
+
+  if (!formatSeg(next, eraseCount)) return false;
+
+  active = next;
+  writeOff = sizeof(SegHeader);
+
+  // the replay cursor was in the recycled segment: continue at the oldest
+  if (curSeg == next) {
+    curSeg = (next + 1) % segCount;
+    curOff = sizeof(SegHeader);
+  }
+  return true;
+}
+
+bool PersistentOutbox::append(const char* topic, const char* payload, uint8_t qos, bool retain) {
+  if (!topic || !*topic) return false;
+  if (!payload) payload = "";
+
+  const size_t tlen = std::strlen(topic);
+  const size_t plen = std::strlen(payload);
+  const size_t len = tlen + 1 + plen + 1;
+  if (sizeof(RecHeader) + len > MAX_RECORD) return false;
+
+  OutboxGuard g(lock);
+  if (!isOpen()) return false;
+
+  const uint32_t size = align4((uint32_t)(sizeof(RecHeader) + len));
+  if (writeOff + size > segBytes && !rotate()) return false;
+
+  uint8_t* data = wbuf + sizeof(RecHeader);
+  std::memcpy(data, topic, tlen + 1);
+  std::memcpy(data + tlen + 1, payload, plen + 1);
+
+  RecHeader h{REC_MAGIC, (uint16_t)len, REC_LIVE,
+              (uint8_t)((qos & 3U) | (retain ? 4U : 0U)), (uint16_t)tlen, 0};
+  h.crc = recordCrc(h, data);
+  std::memcpy(wbuf, &h, sizeof(h));
+
+  if (!writeAt((uint32_t)active * segBytes + writeOff, wbuf, sizeof(h) + len)) {
+    // unknown bytes may be left behind; never write over them
+    writeOff = segBytes;
+    return false;
+  }
+
+  writeOff += size;
+  segLive[active]++;
+  counters.live++;
+  counters.appended++;
+  counters.userBytes += (uint32_t)(tlen + plen);
+  counters.flashBytes += (uint32_t)(sizeof(h) + len);
+  return true;
+}
+
+// Replay
+
+void PersistentOutbox::rewind() {
+  OutboxGuard g(lock);
+  if (!segCount) return;
+
+  curSeg = (active + 1) % segCount;
+  curOff = sizeof(SegHeader);
+}
+
+bool PersistentOutbox::next(Record& out) {
+  OutboxGuard g(lock);
+  if (!isOpen()) return false;
+
+  for (size_t hops = 0; hops < segCount;) {
+    if (segSeq[curSeg] && !(curSeg == active && curOff >= writeOff)) {
+      RecHeader h;
+      bool valid = true;
+      const uint32_t sz = readRecord(curSeg, curOff, h, valid);
+
+      if (sz) {
+        const uint32_t off = curOff;
+        curOff += sz;
+        if (!valid || h.state != REC_LIVE) continue;
+
+        out.ref = Ref{segSeq[curSeg], (uint16_t)curSeg, (uint16_t)off};
+        out.topic = (const char*)rbuf;
+        out.payload = (const char*)rbuf + h.topicLen + 1;
+        out.qos = h.flags & 3U;
+        out.retain = (h.flags & 4U) != 0;
+        counters.replayed++;
+        return true;
+      }
+    }
+
+    if (curSeg == active) return false;
+    curSeg = (curSeg + 1) % segCount;
+    curOff = sizeof(SegHeader);
+    ++hops;
+  }
+  return false;
+}
+
+bool PersistentOutbox::release(const Ref& ref) {
+  OutboxGuard g(lock);
+  if (!isOpen() || ref.seg >= segCount || segSeq[ref.seg] != ref.seq) return false;
+
+  const uint32_t addr = (uint32_t)ref.seg * segBytes + ref.off + offsetof(RecHeader, state);
+
+  uint8_t state = REC_DONE;
+  if (!readAt(addr, &state, 1)) return false;
+  if (state != REC_LIVE) return true;
+
+  state = REC_DONE;
+  if (!writeAt(addr, &state, 1)) return false;
+  counters.flashBytes += 1;
+
+  if (segLive[ref.seg]) segLive[ref.seg]--;
+  if (counters.live) counters.live--;
+  counters.released++;
+  return true;
+}
+
+PersistentOutbox::Stats PersistentOutbox::stats() const {
+  OutboxGuard g(lock);
+  return counters;
+}
+
+// CRC-32 (IEEE, reflected), nibble table
+
+uint32_t PersistentOutbox::crc32(uint32_t crc, const void* data, size_t len) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ table[crc & 15U];
+    crc = (crc >> 4) ^ table[crc & 15U];
+  }
+  return ~crc;
+}
+
+// Everything but `state` (cleared on release) and the crc itself.
+uint32_t PersistentOutbox::recordCrc(const RecHeader& h, const void* data) {
+  RecHeader c = h;
+  c.state = REC_LIVE;
+  c.crc = 0;
+  return crc32(crc32(0, &c, sizeof(c)), data, h.len);
+}
+
+} // namespace statemq
@@ -9,6 +9,8 @@
 // Behavior:
 // - Periodic tasks react to the current state (level)
 // - onStateChange() reacts to transitions (edge)
+// - taskOnTransition() runs edge work on its own task; it sleeps until a
+//   matching transition occurs instead of polling with a `static last`
 
 #include <cstring>
 
@@ -104,6 +106,21 @@ static void onEdge(const StateMQ::StateChangeCtx& ctx) {
   }
 }
 
+// ---------------- EDGE TASK ----------------
+//
+// Woken only on * -> HELLO. Runs on its own stack, so it may block.
+static void helloEdgeTask(const StateMQ::StateChangeCtx& ctx) {
+  printf("[edge-task] %s -> HELLO via %s=%s\n",
+         node.stateName(ctx.prev),
+         ctx.topic ? ctx.topic : "-",
+         ctx.payload ? ctx.payload : "-");
+
+  // blocking is fine here: acknowledge with a short LED pulse
+  ledWrite(false);
+  vTaskDelay(pdMS_TO_TICKS(200));
+  ledWrite(true);
+}
+
 extern "C" void app_main(void) {
   // GPIO setup
   gpio_config_t io{};
@@ -123,6 +140,10 @@ extern "C" void app_main(void) {
   // edge call
   node.onStateChange(onEdge);
 
+  // edge task (no polling period)
+  node.taskOnTransition("hello_edge", Stack::Small, helloEdgeTask, nullptr,
+                        StateMQ::ANY_STATE, HELLO_ID);
+
   // Subscribe to state topic with specific QoS
   esp.StatePublishTopic("hello/status", /*qos=*/1, /*retain*/true, /*enable=*/true);
 
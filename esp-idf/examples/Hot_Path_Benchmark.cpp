@@ -0,0 +1,95 @@
+// main/app_main.cpp
+//
+// StateMQ ESP-IDF example: hot-path benchmark.
+//
+// MQTT interface (what to publish / subscribe):
+// - Subscribe to: bench/status
+//   Messages:     {"prev":"A","curr":"B","uptime_ms":...} per transition
+//
+// Notes:
+// - Every 2 s, once connected, prints:
+//     poll:  ns per msg() call over 16 subscriptions, by topic string
+//            and by the RawHandle returned from subscribe()
+//     state: transitions/s through applyMessage() with state publishing
+//            enabled (the payload is built and sent on the timer task)
+// - Numbers depend on the CPU clock and flash cache; build with -O2 and
+//   compare runs on the same board.
+//
+
+#include <cstdio>
+
+#include "sdkconfig.h"
+#include "StateMQ_ESP.h"
+
+#include "esp_timer.h"
+
+using namespace statemq;
+
+// ---------------- topics ----------------
+static constexpr size_t      SUBS        = 16;
+static constexpr const char* STATE_TOPIC = "bench/cmd";
+
+// ---------------- node ----------------
+static StateMQ node;
+static StateMQEsp esp(node);
+
+static char topics[SUBS][48];
+static StateMQEsp::RawHandle handles[SUBS];
+
+static volatile uintptr_t sink;
+
+// ---------------- tasks ----------------
+
+// Task 1: lookup cost of msg(topic) vs msg(handle)
+static void pollBench() {
+  static constexpr int N = 20000;
+
+  int64_t t0 = esp_timer_get_time();
+  for (int n = 0; n < N; ++n) sink += (uintptr_t)esp.msg(topics[n % SUBS]);
+  const int64_t byTopic = esp_timer_get_time() - t0;
+
+  t0 = esp_timer_get_time();
+  for (int n = 0; n < N; ++n) sink += (uintptr_t)esp.msg(handles[n % SUBS]);
+  const int64_t byHandle = esp_timer_get_time() - t0;
+
+  printf("poll:  msg(topic) %.0f ns  msg(handle) %.0f ns\n",
+         byTopic * 1000.0 / N, byHandle * 1000.0 / N);
+}
+
+// Task 2: transition rate with state publishing on
+static void stateBench() {
+  static constexpr int N = 2000;
+
+  const int64_t t0 = esp_timer_get_time();
+  for (int n = 0; n < N; ++n) node.applyMessage(STATE_TOPIC, (n & 1) ? "b" : "a");
+  const int64_t us = esp_timer_get_time() - t0;
+
+  printf("state: %.0f transitions/s (%.2f us each)\n", N * 1e6 / us, (float)us / N);
+}
+
+static void benchTask() {
+  if (!node.connected()) return;
+  pollBench();
+  stateBench();
+}
+
+extern "C" void app_main(void) {
+  for (size_t i = 0; i < SUBS; ++i) {
+    snprintf(topics[i], sizeof(topics[i]), "bench/site/room%02u/telemetry", (unsigned)i);
+    handles[i] = esp.subscribe(topics[i], /*qos=*/0);
+  }
+
+  node.map(STATE_TOPIC, "a", "A");
+  node.map(STATE_TOPIC, "b", "B");
+
+  node.taskEvery("bench", 2000, Stack::Large, benchTask, true);
+
+  esp.StatePublishTopic("bench/status", /*qos=*/0, /*enable=*/true, /*retain=*/false);
+
+  // menuconfig credentials
+  const char* ssid   = CONFIG_STATEMQ_WIFI_SSID;
+  const char* pass   = CONFIG_STATEMQ_WIFI_PASS;
+  const char* broker = CONFIG_STATEMQ_BROKER_URI;
+
+  esp.begin(ssid, pass, broker);
+}
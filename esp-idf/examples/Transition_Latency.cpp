@@ -0,0 +1,117 @@
+// main/app_main.cpp
+//
+// StateMQ ESP-IDF example: transition task vs polling, wakeups and latency.
+//
+// MQTT interface:
+// - Publish to:   lat/cmd
+//   Payloads:     "a", "b" (the example also drives them itself)
+//
+// Notes:
+// - Once connected, a driver task flips the state every 250 ms by feeding
+//   the same (topic, payload) pairs a broker message would.
+// - Two observers react to each flip:
+//     edge: taskOnTransition(), woken by a task notification
+//     poll: taskEvery() at 20 ms comparing against a static `last`, the
+//           pattern Edge_Context_Transition.cpp replaces
+// - Every 5 s prints, per observer, wakeups/s and the mean / max delay
+//   from the flip to the observer running.
+//
+
+#include <cstdio>
+
+#include "sdkconfig.h"
+#include "StateMQ_ESP.h"
+
+#include "esp_timer.h"
+
+using namespace statemq;
+
+// ---------------- topics ----------------
+static constexpr const char* CMD_TOPIC = "lat/cmd";
+static constexpr uint32_t    POLL_MS   = 20;
+
+// ---------------- node ----------------
+static StateMQ node;
+static StateMQEsp esp(node);
+
+using StateId = StateMQ::StateId;
+static StateId A_ID = StateMQ::CONNECTED_ID;
+static StateId B_ID = StateMQ::CONNECTED_ID;
+
+// ---------------- measurements ----------------
+struct Probe {
+  uint32_t wakeups;
+  uint32_t seen;
+  int64_t  sumUs;
+  int64_t  maxUs;
+};
+
+static volatile int64_t flipUs = 0;
+static Probe edgeProbe{};
+static Probe pollProbe{};
+
+static void record(Probe& p) {
+  const int64_t d = esp_timer_get_time() - flipUs;
+  p.seen++;
+  p.sumUs += d;
+  if (d > p.maxUs) p.maxUs = d;
+}
+
+static void report(const char* name, Probe& p, float secs) {
+  printf("%s: %.1f wakeups/s  latency mean %lld us  max %lld us  (%u flips)\n",
+         name, p.wakeups / secs,
+         p.seen ? (long long)(p.sumUs / p.seen) : 0LL,
+         (long long)p.maxUs, (unsigned)p.seen);
+  p = Probe{};
+}
+
+// ---------------- tasks ----------------
+
+// Task 1: flip A <-> B
+static void driverTask() {
+  if (!node.connected()) return;
+  const bool toA = node.stateId() != A_ID;
+  flipUs = esp_timer_get_time();
+  node.applyMessage(CMD_TOPIC, toA ? "a" : "b");
+}
+
+// Task 2: polling observer
+static void pollTask() {
+  static StateId last = StateMQ::OFFLINE_ID;
+  pollProbe.wakeups++;
+
+  const StateId s = node.stateId();
+  if (s == last) return;
+  last = s;
+  if (s == A_ID || s == B_ID) record(pollProbe);
+}
+
+// Task 3: transition observer, runs once per A/B edge
+static void edgeTask(const StateMQ::StateChangeCtx& ctx) {
+  edgeProbe.wakeups++;
+  if (ctx.curr == A_ID || ctx.curr == B_ID) record(edgeProbe);
+}
+
+static void reportTask() {
+  report("edge", edgeProbe, 5.0f);
+  report("poll", pollProbe, 5.0f);
+}
+
+extern "C" void app_main(void) {
+  A_ID = node.map(CMD_TOPIC, "a", "A");
+  B_ID = node.map(CMD_TOPIC, "b", "B");
+
+  node.taskEvery("driver", 250, Stack::Small, driverTask, true);
+  node.taskEvery("poll", POLL_MS, Stack::Small, pollTask, true);
+  node.taskEvery("report", 5000, Stack::Medium, reportTask, true);
+  node.taskOnTransition("edge", Stack::Small, edgeTask);
+
+  esp.subscribe(CMD_TOPIC, /*qos=*/0);
+
+  // menuconfig credentials
+  const char* ssid   = CONFIG_STATEMQ_WIFI_SSID;
+  const char* pass   = CONFIG_STATEMQ_WIFI_PASS;
+  const char* broker = CONFIG_STATEMQ_BROKER_URI;
+
+  esp.begin(ssid, pass, broker);
+}